@@ -2,6 +2,60 @@
 #include <math.h>
 #include <assert.h>
 #include "uwnet.h"
+#include "parallel.h"
+
+typedef struct {
+    ACTIVATION a;
+    matrix x, y;
+} activation_args;
+
+static void activate_row(int i, void *ptr)
+{
+    activation_args *p = ptr;
+    ACTIVATION a = p->a;
+    matrix x = p->x, y = p->y;
+    int j;
+    float *xi = x.data + i*x.ld;
+    float *yi = y.data + i*y.ld;
+    float sum = 0;
+    for(j = 0; j < x.cols; ++j){
+        float v = xi[j];
+        if(a == LOGISTIC){
+            yi[j] = 1/(1+expf(-v));
+        } else if (a == RELU){
+            yi[j] = (v>0)*v;
+        } else if (a == LRELU){
+            yi[j] = (v>0) ? v : .01*v;
+        } else if (a == SOFTMAX){
+            yi[j] = expf(v);
+        }
+        sum += yi[j];
+    }
+    if (a == SOFTMAX) {
+        for(j = 0; j < x.cols; ++j){
+            yi[j] /= sum;
+        }
+    }
+}
+
+static void gradient_row(int i, void *ptr)
+{
+    activation_args *p = ptr;
+    ACTIVATION a = p->a;
+    matrix x = p->x, dx = p->y;
+    int j;
+    for(j = 0; j < dx.cols; ++j){
+        float v = x.data[i*x.ld + j];
+        if(a == LOGISTIC){
+            float fx = 1/(1 + exp(-v));
+            dx.data[i*dx.ld + j] *= fx*(1-fx);
+        } else if (a == RELU){
+            dx.data[i*dx.ld + j] *= (v>0) ? 1 : 0;
+        } else if (a == LRELU){
+            dx.data[i*dx.ld + j] *= (v>0) ? 1 : 0.01;
+        }
+    }
+}
 
 
 // Run an activation layer on input
@@ -24,30 +78,8 @@ matrix forward_activation_layer(layer l, matrix x)
     // relu(x)     = x if x > 0 else 0
     // lrelu(x)    = x if x > 0 else .01 * x
     // softmax(x)  = e^{x_i} / sum(e^{x_j}) for all x_j in the same row 
-    int i, j;
-    for(i = 0; i < x.rows; ++i){
-        float sum = 0;
-        for(j = 0; j < x.cols; ++j){
-            int index = i*x.cols + j;
-            float v = x.data[index];
-            if(a == LOGISTIC){
-                y.data[index] = 1/(1+expf(-v));
-            } else if (a == RELU){
-                y.data[index] = (v>0)*v;
-            } else if (a == LRELU){
-                y.data[index] = (v>0) ? v : .01*v;
-            } else if (a == SOFTMAX){
-                y.data[index] = expf(v);
-            }
-            sum += y.data[index];
-        }
-        if (a == SOFTMAX) {
-            for(j = 0; j < x.cols; ++j){
-                int index = i*x.cols + j;
-                y.data[index] /= sum;
-            }
-        }
-    }
+    activation_args args = {a, x, y};
+    parallel_for(x.rows, activate_row, &args);
 
     return y;
 }
@@ -72,20 +104,8 @@ matrix backward_activation_layer(layer l, matrix dy)
     // d/dx lrelu(x)    = 1 if x > 0 else 0.01
     // d/dx softmax(x)  = 1
 
-    int i, j;
-    for(i = 0; i < dx.rows; ++i){
-        for(j = 0; j < dx.cols; ++j){
-            float v = x.data[i*x.cols + j];
-            if(a == LOGISTIC){
-                float fx = 1/(1 + exp(-v));
-                dx.data[i*dx.cols + j] *= fx*(1-fx);
-            } else if (a == RELU){
-                dx.data[i*dx.cols + j] *= (v>0) ? 1 : 0;
-            } else if (a == LRELU){
-                dx.data[i*dx.cols + j] *= (v>0) ? 1 : 0.01;
-            }
-        }
-    }
+    activation_args args = {a, x, dx};
+    parallel_for(dx.rows, gradient_row, &args);
 
     return dx;
 }
@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "uwnet.h"
+#include "pool.h"
+#include "parallel.h"
+
+// From data.c
+void example_to_floats(data d, int i, float *dst);
+
+// Turn on augmentation of training batches drawn from a data set
+// Each example is resampled from a randomly placed window: the window is
+// zoomed in by up to 1+scale, shifted up to crop pixels past the edges
+// (edge pixels repeat), and mirrored left to right half the time if flip.
+// augment a: size of each example image and how much to jitter it,
+//            a.w = 0 turns augmentation off
+void augment_data(data *d, augment a)
+{
+    assert(!a.w || a.w*a.h*a.c == d->x.cols);
+    assert(a.scale >= 0 && a.crop >= 0);
+    d->aug = a;
+}
+
+// Where one output row or column comes from: blend src[i0] and src[i1]
+typedef struct {
+    int *i0, *i1;
+    float *f;
+} taps;
+
+// Fill in the sampling taps along one axis
+// int n: pixels along this axis
+// float start: source coordinate of the window's first edge
+// float step: source pixels per output pixel
+// int flip: run the output backwards
+static void make_taps(taps t, int n, float start, float step, int flip)
+{
+    int j;
+    for(j = 0; j < n; ++j){
+        int o = flip ? n-1-j : j;
+        float s = start + (o + .5f)*step - .5f;
+        if(s < 0) s = 0;
+        if(s > n-1) s = n-1;
+        int i0 = (int)s;
+        t.i0[j] = i0;
+        t.i1[j] = i0 < n-1 ? i0+1 : i0;
+        t.f[j] = s - i0;
+    }
+}
+
+// Resample one plane through precomputed taps
+static void resample_plane(float *src, float *dst, int w, int h, taps xt, taps yt)
+{
+    int i, j;
+    for(i = 0; i < h; ++i){
+        float *r0 = src + yt.i0[i]*w;
+        float *r1 = src + yt.i1[i]*w;
+        float fy = yt.f[i];
+        float *out = dst + i*w;
+        j = 0;
+#ifdef __AVX2__
+        __m256 vfy = _mm256_set1_ps(fy);
+        for(; j + 8 <= w; j += 8){
+            __m256i a = _mm256_loadu_si256((__m256i *)(xt.i0 + j));
+            __m256i b = _mm256_loadu_si256((__m256i *)(xt.i1 + j));
+            __m256 fx = _mm256_loadu_ps(xt.f + j);
+            __m256 t0 = _mm256_i32gather_ps(r0, a, 4);
+            __m256 t1 = _mm256_i32gather_ps(r0, b, 4);
+            __m256 b0 = _mm256_i32gather_ps(r1, a, 4);
+            __m256 b1 = _mm256_i32gather_ps(r1, b, 4);
+            __m256 top = _mm256_add_ps(t0, _mm256_mul_ps(_mm256_sub_ps(t1, t0), fx));
+            __m256 bot = _mm256_add_ps(b0, _mm256_mul_ps(_mm256_sub_ps(b1, b0), fx));
+            _mm256_storeu_ps(out + j, _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bot, top), vfy)));
+        }
+#endif
+        for(; j < w; ++j){
+            float top = r0[xt.i0[j]] + (r0[xt.i1[j]] - r0[xt.i0[j]])*xt.f[j];
+            float bot = r1[xt.i0[j]] + (r1[xt.i1[j]] - r1[xt.i0[j]])*xt.f[j];
+            out[j] = top + (bot - top)*fy;
+        }
+    }
+}
+
+typedef struct {
+    data d;
+    int *ind;
+    data b;
+    unsigned long long *seeds;
+} augment_args;
+
+static float rand_unit(unsigned long long *state)
+{
+    return rand_next(state) * (1.f/4294967296.f);
+}
+
+static void augment_example(int i, void *ptr)
+{
+    augment_args *args = ptr;
+    data d = args->d;
+    augment a = d.aug;
+    int k;
+    int spatial = a.w*a.h;
+    unsigned long long state = args->seeds[i];
+
+    float zoom = 1 + a.scale*rand_unit(&state);
+    float ww = a.w/zoom;
+    float wh = a.h/zoom;
+    float x = -a.crop + (a.w - ww + 2*a.crop)*rand_unit(&state);
+    float y = -a.crop + (a.h - wh + 2*a.crop)*rand_unit(&state);
+    int flip = a.flip && (rand_next(&state) & 1);
+
+    // One block for the taps and, for 8-bit or lazy data, the example as floats
+    int convert = !has_float_examples(d);
+    size_t floats = 3*(a.w + a.h) + (convert ? d.x.cols : 0);
+    float *scratch = pool_calloc(floats, sizeof(float));
+    taps xt = {(int *)scratch, (int *)scratch + a.w, scratch + 2*a.w};
+    taps yt = {(int *)scratch + 3*a.w, (int *)scratch + 3*a.w + a.h, scratch + 3*a.w + 2*a.h};
+    make_taps(xt, a.w, x, 1/zoom, flip);
+    make_taps(yt, a.h, y, 1/zoom, 0);
+
+    int j = args->ind[i];
+    float *src = d.x.data + (size_t)j*d.x.ld;
+    if(convert){
+        src = scratch + 3*(a.w + a.h);
+        example_to_floats(d, j, src);
+    }
+    float *dst = args->b.x.data + (size_t)i*args->b.x.ld;
+    for(k = 0; k < a.c; ++k){
+        resample_plane(src + k*spatial, dst + k*spatial, a.w, a.h, xt, yt);
+    }
+    pool_free(scratch);
+
+    if(d.labels){
+        args->b.labels[i] = d.labels[j];
+    } else {
+        memcpy(args->b.y.data + (size_t)i*args->b.y.ld, d.y.data + (size_t)j*d.y.ld, d.y.cols*sizeof(float));
+    }
+}
+
+// Like gather_batch but each example goes through d.aug on the way
+// Examples are spread across worker threads and written straight into
+// the rows of b. The jitter only depends on state, not on the threads.
+// data d: data set with augmentation turned on
+// int *ind: which example goes in each row of b
+// data b: batch to fill
+// unsigned long long *state: random state, updated
+void augment_batch(data d, int *ind, data b, unsigned long long *state)
+{
+    int i;
+    augment_args args = {d, ind, b};
+    args.seeds = calloc(b.x.rows, sizeof(unsigned long long));
+    for(i = 0; i < b.x.rows; ++i){
+        unsigned long long hi = rand_next(state);
+        args.seeds[i] = hi << 32 | rand_next(state);
+    }
+    parallel_for(b.x.rows, augment_example, &args);
+    free(args.seeds);
+}
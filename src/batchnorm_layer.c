@@ -2,6 +2,112 @@
 #include <math.h>
 #include <assert.h>
 #include "uwnet.h"
+#include "parallel.h"
+
+// Groups are independent, so the statistics are split up a group at a
+// time and the normalizing a row at a time
+typedef struct {
+    matrix x, d;
+    matrix m, v, dm, dv;
+    matrix out;
+    int n;
+} norm_args;
+
+static void mean_group(int g, void *ptr)
+{
+    norm_args *a = ptr;
+    matrix x = a->x;
+    int i, j, n = a->n;
+    float sum = 0;
+    for(i = 0; i < x.rows; ++i){
+        const float *xi = x.data + i*x.ld + g*n;
+        for(j = 0; j < n; ++j){
+            sum += xi[j];
+        }
+    }
+    a->out.data[g] = sum / x.rows / n;
+}
+
+static void variance_group(int g, void *ptr)
+{
+    norm_args *a = ptr;
+    matrix x = a->x, m = a->m;
+    int i, j, n = a->n;
+    float sum = 0;
+    for(i = 0; i < x.rows; ++i){
+        const float *xi = x.data + i*x.ld + g*n;
+        for(j = 0; j < n; ++j){
+            sum += (xi[j] - m.data[g])*(xi[j] - m.data[g]);
+        }
+    }
+    a->out.data[g] = sum / x.rows / n;
+}
+
+static void normalize_row(int i, void *ptr)
+{
+    norm_args *a = ptr;
+    matrix x = a->x, m = a->m, v = a->v, norm = a->out;
+    float eps = 0.00001f;
+    int j, n = a->n;
+    for(j = 0; j < x.cols; ++j){
+        norm.data[i*norm.ld + j] += ((x.data[i*x.ld + j] - m.data[j/n])/sqrtf(v.data[j/n] + eps));
+    }
+}
+
+static void delta_mean_group(int g, void *ptr)
+{
+    norm_args *a = ptr;
+    matrix d = a->d, v = a->v;
+    float eps = 0.00001f;
+    int i, j, n = a->n;
+    float sum = 0;
+    for(i = 0; i < d.rows; ++i){
+        for(j = g*n; j < (g+1)*n; ++j){
+            sum += (d.data[i*d.ld + j] * (-1/sqrtf(v.data[g] + eps)));
+        }
+    }
+    a->out.data[g] = sum;
+}
+
+static void delta_variance_group(int g, void *ptr)
+{
+    norm_args *a = ptr;
+    matrix d = a->d, x = a->x;
+    float eps = 0.00001f;
+    int i, j, n = a->n;
+    float mu_val = a->m.data[g];
+    float var_val = a->v.data[g] + eps;
+    float power_val = (-0.5)*powf(var_val, -1.5);
+    float sum = 0;
+    for(i = 0; i < d.rows; ++i){
+        for(j = g*n; j < (g+1)*n; ++j){
+            float dL_dy = d.data[i*d.ld + j];
+            float x_val = x.data[i*x.ld + j];
+            sum += (dL_dy * (x_val - mu_val) * power_val);
+        }
+    }
+    a->out.data[g] = sum;
+}
+
+static void delta_batch_norm_row(int i, void *ptr)
+{
+    norm_args *a = ptr;
+    matrix d = a->d, x = a->x, m = a->m, v = a->v, dm = a->dm, dv = a->dv, dx = a->out;
+    float eps = 0.00001f;
+    int j, n = a->n;
+    int total = x.rows * n;
+    for(j = 0; j < x.cols; ++j){
+        float dL_dy = d.data[i*d.ld + j];
+        float x_val = x.data[i*x.ld + j];
+        float mu_val = m.data[j/n];
+        float dL_dmu = dm.data[j/n];
+        float var_val = sqrtf(v.data[j/n] + eps);
+        float dL_ds2 = dv.data[j/n];
+
+        float temp = (dL_dy/var_val) + (dL_ds2 * 2 * (x_val - mu_val)/total) + (dL_dmu/total);
+        dx.data[i*dx.ld + j] = temp;
+    }
+}
 
 // Take mean of matrix x over rows and spatial dimension
 // matrix x: matrix with data
@@ -12,16 +118,8 @@ matrix mean(matrix x, int groups)
 {
     assert(x.cols % groups == 0);
     matrix m = make_matrix(1, groups);
-    int n = x.cols / groups;
-    int i, j;
-    for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            m.data[j/n] += x.data[i*x.cols + j];
-        }
-    }
-    for(i = 0; i < m.cols; ++i){
-        m.data[i] = m.data[i] / x.rows / n;
-    }
+    norm_args a = {.x = x, .out = m, .n = x.cols / groups};
+    parallel_for(groups, mean_group, &a);
     return m;
 }
 
@@ -30,16 +128,8 @@ matrix variance(matrix x, matrix m, int groups)
 {
     //assert(x.cols % groups == 0);
     matrix v = make_matrix(1, groups);
-    int n = x.cols / groups;
-    int i, j;
-    for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            v.data[j/n] += ((x.data[i*x.cols + j] - m.data[j/n])*(x.data[i*x.cols + j] - m.data[j/n]));
-        }
-    }
-    for(i = 0; i < v.cols; ++i){
-        v.data[i] = v.data[i] / x.rows / n;
-    }
+    norm_args a = {.x = x, .m = m, .out = v, .n = x.cols / groups};
+    parallel_for(groups, variance_group, &a);
     return v;
 }
 
@@ -49,15 +139,8 @@ matrix normalize(matrix x, matrix m, matrix v, int groups)
 {
     matrix norm = make_matrix(x.rows, x.cols);
     // TODO: 7.2 - Normalize x
-    float eps = 0.00001f;
-    int n = x.cols / groups;
-
-    int i, j;
-    for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            norm.data[i*x.cols + j] += ((x.data[i*x.cols + j] - m.data[j/n])/sqrtf(v.data[j/n] + eps));
-        }
-    }
+    norm_args a = {.x = x, .m = m, .v = v, .out = norm, .n = x.cols / groups};
+    parallel_for(x.rows, normalize_row, &a);
     return norm;
 }
 
@@ -106,15 +189,8 @@ matrix delta_mean(matrix d, matrix v)
     */
 
     // TODO 7.3 - Calculate dL/dm
-    float eps = 0.00001f;
-    int n = d.cols / groups;
-    int i, j;
-
-    for(i = 0; i < d.rows; ++i){
-        for(j = 0; j < d.cols; ++j){
-            dm.data[j/n] += (d.data[i*d.cols + j] * (-1/sqrtf(v.data[j/n] + eps)));
-        }
-    }
+    norm_args a = {.d = d, .v = v, .out = dm, .n = d.cols / groups};
+    parallel_for(groups, delta_mean_group, &a);
 
     return dm;
 }
@@ -134,31 +210,8 @@ matrix delta_variance(matrix d, matrix x, matrix m, matrix v)
     */
 
     // TODO 7.4 - Calculate dL/dv
-    float eps = 0.00001f;
-    int n = d.cols / groups;
-    int i, j;
-
-    for(i = 0; i < d.rows; ++i){
-        for(j = 0; j < d.cols; ++j){
-            float dL_dy = d.data[i*d.cols + j];
-            //printf("dL/dy: %f ", dL_dy);
-
-            float x_val = x.data[i*d.cols + j];
-            //printf("x_val: %f ", x_val);
-
-            float mu_val = m.data[j/n];
-            //printf("mu_val: %f ", mu_val);
-
-            float var_val = v.data[j/n] + eps;
-            //printf("var_val: %f ", var_val);
-
-            float power_val = (-0.5)*powf(var_val, -1.5);
-            //printf("power_val: %f ", power_val);
-
-            float temp = (dL_dy * (x_val - mu_val) * power_val);
-            dv.data[j/n] += temp;
-        }
-    }
+    norm_args a = {.x = x, .d = d, .m = m, .v = v, .out = dv, .n = d.cols / groups};
+    parallel_for(groups, delta_variance_group, &a);
 
     return dv;
 }
@@ -177,26 +230,8 @@ matrix delta_batch_norm(matrix d, matrix dm, matrix dv, matrix m, matrix v, matr
     */
    
     // TODO 7.5 - Calculate dL/dx
-    float eps = 0.00001f;
-    int i, j;
-    int groups = m.cols;
-    int n = x.cols / groups;
-    int total = x.rows * n;
-   
-    for(i = 0; i < x.rows; ++i){
-        for(j = 0; j < x.cols; ++j){
-            float dL_dy = d.data[i*x.cols + j];
-            float x_val = x.data[i*x.cols + j];
-            float mu_val = m.data[j/n];
-            float dL_dmu = dm.data[j/n];
-            float var_val1 = v.data[j/n];
-            float var_val = sqrtf(v.data[j/n] + eps);
-            float dL_ds2 = dv.data[j/n];
-
-            float temp = (dL_dy/var_val) + (dL_ds2 * 2 * (x_val - mu_val)/total) + (dL_dmu/total);
-            dx.data[i*d.cols + j] = temp;
-        }
-    }
+    norm_args a = {x, d, m, v, dm, dv, dx, x.cols / m.cols};
+    parallel_for(x.rows, delta_batch_norm_row, &a);
     return dx;
 }
 
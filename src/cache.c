@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "uwnet.h"
+#include "pool.h"
+#include "matcher.h"
+#include "fileio.h"
+#include "parallel.h"
+
+// A lazy data set keeps only paths and labels. Images are decoded the
+// first time a batch asks for them and kept in a cache that holds as
+// many decoded rows as fit in its budget, dropping the least recently
+// used row when it needs room.
+//
+// A compressed data set works the same way with a budget of 0, but reads
+// every file into one blob up front so decoding never touches the disk.
+
+typedef struct entry{
+    int index;
+    int refs;
+    struct entry *prev, *next;
+    float *data;
+} entry;
+
+struct image_cache{
+    lines paths;
+    unsigned char *blob;    // encoded files back to back, or 0 to read paths
+    size_t *offsets;        // file i is blob[offsets[i], offsets[i+1])
+    int w, h, c;
+    int cols;
+    size_t budget;
+    size_t used;
+
+    // Cached rows by example, and most recently used first
+    entry **slots;
+    entry *head, *tail;
+    long long hits, misses;
+    pthread_mutex_t lock;
+};
+
+// From data.c
+int find_labels(matcher *labels, char *path, int *first);
+
+static void unlink_entry(image_cache *c, entry *e)
+{
+    if(e->prev) e->prev->next = e->next;
+    else c->head = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = e->next = 0;
+}
+
+static void push_front(image_cache *c, entry *e)
+{
+    e->prev = 0;
+    e->next = c->head;
+    if(c->head) c->head->prev = e;
+    c->head = e;
+    if(!c->tail) c->tail = e;
+}
+
+// Drop least recently used rows until another row fits
+// Rows being copied out by another thread are skipped.
+static void make_room(image_cache *c)
+{
+    size_t row = (size_t)c->cols*sizeof(float);
+    entry *e = c->tail;
+    while(e && c->used + row > c->budget){
+        entry *prev = e->prev;
+        if(!e->refs){
+            unlink_entry(c, e);
+            c->slots[e->index] = 0;
+            c->used -= row;
+            pool_free(e->data);
+            free(e);
+        }
+        e = prev;
+    }
+}
+
+// Decode an image to the cache's size and channels
+// Big JPEGs are decoded at reduced scale when the cache size is smaller.
+static void decode_example(image_cache *c, int i, float *dst)
+{
+    image im;
+    if(c->blob){
+        im = load_image_memory_scaled(c->blob + c->offsets[i], c->offsets[i+1] - c->offsets[i], c->c, c->w, c->h);
+    } else {
+        im = load_image_scaled(c->paths.line[i], c->c, c->w, c->h);
+    }
+    memcpy(dst, im.data, c->cols*sizeof(float));
+    free_image(im);
+}
+
+// Keep a copy of a freshly decoded row if it fits in the budget
+static void insert_row(image_cache *c, int i, float *src)
+{
+    size_t row = (size_t)c->cols*sizeof(float);
+    if(row > c->budget) return;
+    entry *e = calloc(1, sizeof(entry));
+    e->index = i;
+    e->data = pool_calloc(c->cols, sizeof(float));
+    memcpy(e->data, src, row);
+
+    pthread_mutex_lock(&c->lock);
+    if(c->slots[i]){
+        // Someone else decoded it while we were
+        pthread_mutex_unlock(&c->lock);
+        pool_free(e->data);
+        free(e);
+        return;
+    }
+    make_room(c);
+    if(c->used + row <= c->budget){
+        c->slots[i] = e;
+        c->used += row;
+        push_front(c, e);
+        e = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+    if(e){
+        pool_free(e->data);
+        free(e);
+    }
+}
+
+// Write example i into dst, decoding it if it isn't cached
+// Safe to call from several threads at once.
+void cache_example(image_cache *c, int i, float *dst)
+{
+    size_t row = (size_t)c->cols*sizeof(float);
+    pthread_mutex_lock(&c->lock);
+    entry *e = c->slots[i];
+    if(e){
+        ++c->hits;
+        ++e->refs;
+        unlink_entry(c, e);
+        push_front(c, e);
+        pthread_mutex_unlock(&c->lock);
+        memcpy(dst, e->data, row);
+        pthread_mutex_lock(&c->lock);
+        --e->refs;
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    ++c->misses;
+    pthread_mutex_unlock(&c->lock);
+
+    // Decode without holding the lock so other threads can keep going
+    decode_example(c, i, dst);
+    insert_row(c, i, dst);
+}
+
+typedef struct {
+    image_cache *c;
+    int *ind;
+    entry **hit;
+    int *miss;
+    char **paths;
+    float *dst;
+    int ld;
+} batch_args;
+
+static void copy_hit(int k, void *ptr)
+{
+    batch_args *a = ptr;
+    if(a->hit[k]) memcpy(a->dst + (size_t)k*a->ld, a->hit[k]->data, a->c->cols*sizeof(float));
+}
+
+static void decode_blob_miss(int k, void *ptr)
+{
+    batch_args *a = ptr;
+    int row = a->miss[k];
+    float *dst = a->dst + (size_t)row*a->ld;
+    decode_example(a->c, a->ind[row], dst);
+    insert_row(a->c, a->ind[row], dst);
+}
+
+static void decode_file_miss(int k, unsigned char *buf, size_t size, void *ptr)
+{
+    batch_args *a = ptr;
+    image_cache *c = a->c;
+    int row = a->miss[k];
+    float *dst = a->dst + (size_t)row*a->ld;
+    if(!buf){
+        fprintf(stderr, "Couldn't read file %s\n", a->paths[k]);
+        exit(0);
+    }
+    image im = load_image_memory_scaled(buf, size, c->c, c->w, c->h);
+    memcpy(dst, im.data, c->cols*sizeof(float));
+    free_image(im);
+    insert_row(c, a->ind[row], dst);
+}
+
+// Write several examples into the rows of dst at once
+// Cached rows are copied out and the rest are decoded across worker
+// threads. Without a blob the misses are read together with read_files
+// and decoded from memory, so reading overlaps decoding.
+// int *ind: example for each row
+// int n: number of rows
+// float *dst: rows to fill, row k starts at dst + k*ld
+void cache_batch(image_cache *c, int *ind, int n, float *dst, int ld)
+{
+    int k;
+    int misses = 0;
+    batch_args a = {c, ind, 0, 0, 0, dst, ld};
+    a.hit = calloc(n, sizeof(entry *));
+    a.miss = calloc(n, sizeof(int));
+    pthread_mutex_lock(&c->lock);
+    for(k = 0; k < n; ++k){
+        entry *e = c->slots[ind[k]];
+        if(e){
+            ++c->hits;
+            ++e->refs;
+            unlink_entry(c, e);
+            push_front(c, e);
+            a.hit[k] = e;
+        } else {
+            ++c->misses;
+            a.miss[misses++] = k;
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    parallel_for(n, copy_hit, &a);
+    if(c->blob){
+        parallel_for(misses, decode_blob_miss, &a);
+    } else if(misses){
+        a.paths = calloc(misses, sizeof(char *));
+        for(k = 0; k < misses; ++k) a.paths[k] = c->paths.line[ind[a.miss[k]]];
+        process_files(a.paths, misses, decode_file_miss, &a);
+        free(a.paths);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    for(k = 0; k < n; ++k) if(a.hit[k]) --a.hit[k]->refs;
+    pthread_mutex_unlock(&c->lock);
+    free(a.hit);
+    free(a.miss);
+}
+
+// Get hit and miss counts for a cache
+void cache_stats(image_cache *c, long long *hits, long long *misses)
+{
+    pthread_mutex_lock(&c->lock);
+    *hits = c->hits;
+    *misses = c->misses;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void free_image_cache(image_cache *c)
+{
+    int i;
+    if(!c) return;
+    for(i = 0; i < c->paths.n; ++i){
+        if(c->slots[i]){
+            pool_free(c->slots[i]->data);
+            free(c->slots[i]);
+        }
+    }
+    free(c->slots);
+    pool_free(c->blob);
+    free(c->offsets);
+    free_lines(c->paths);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+static void set_label(int j, void *row)
+{
+    ((float *)row)[j] = 1;
+}
+
+typedef struct {
+    image_cache *c;
+    unsigned char *ok;
+} blob_args;
+
+static void size_file(int i, void *ptr)
+{
+    blob_args *a = ptr;
+    struct stat st;
+    if(stat(a->c->paths.line[i], &st)) return;
+    a->c->offsets[i+1] = st.st_size;
+    a->ok[i] = 1;
+}
+
+// Copy a file into its place in the blob, it must still be the size it was
+static void place_file(int i, unsigned char *buf, size_t size, void *ptr)
+{
+    blob_args *a = ptr;
+    image_cache *c = a->c;
+    if(buf && size == c->offsets[i+1] - c->offsets[i]) memcpy(c->blob + c->offsets[i], buf, size);
+    else a->ok[i] = 0;
+    free(buf);
+}
+
+// Read every file in the list into one pooled blob, many reads at a time
+// The files are sized first so the blob is allocated once, then each is
+// copied into place as soon as it has been read.
+static void read_blob(image_cache *c)
+{
+    int i;
+    int n = c->paths.n;
+    blob_args a = {c, calloc(n, 1)};
+    c->offsets = calloc(n + 1, sizeof(size_t));
+    parallel_for(n, size_file, &a);
+    for(i = 0; i < n; ++i) c->offsets[i+1] += c->offsets[i];
+    c->blob = pool_calloc(c->offsets[n] ? c->offsets[n] : 1, 1);
+    read_files(c->paths.line, n, place_file, &a);
+    int failed = 0;
+    for(i = 0; i < n; ++i){
+        if(a.ok[i]) continue;
+        fprintf(stderr, "Couldn't read file %s\n", c->paths.line[i]);
+        failed = 1;
+    }
+    free(a.ok);
+    if(failed) exit(0);
+}
+
+static data make_lazy_data(char *images, char *label_file, int w, int h, size_t cache_bytes, int compressed)
+{
+    int i;
+    data d = {0};
+    lines label_list = read_lines(label_file);
+    image_cache *c = calloc(1, sizeof(image_cache));
+    c->paths = read_lines(images);
+    int n = c->paths.n;
+    int k = label_list.n;
+    if(!n){
+        fprintf(stderr, "No images in %s\n", images);
+        exit(0);
+    }
+
+    // Only the first image is decoded up front, for the shape of a row
+    image im;
+    if(compressed){
+        read_blob(c);
+        im = load_image_memory(c->blob, c->offsets[1], 0);
+    } else {
+        im = load_image(c->paths.line[0]);
+    }
+    c->w = w ? w : im.w;
+    c->h = h ? h : im.h;
+    c->c = im.c;
+    c->cols = c->w*c->h*c->c;
+    c->budget = cache_bytes;
+    c->slots = calloc(n, sizeof(entry *));
+    pthread_mutex_init(&c->lock, 0);
+    free_image(im);
+
+    // Labels come from the paths so they are cheap to find now
+    matcher *m = make_matcher(label_list.line, k);
+    d.x = float_to_matrix(0, n, c->cols);
+    d.y = float_to_matrix(0, n, k);
+    d.labels = pool_calloc(n, sizeof(int));
+    for(i = 0; i < n; ++i){
+        if(find_labels(m, c->paths.line[i], &d.labels[i]) > 1) break;
+    }
+    if(i < n){
+        // Some path matched several labels, only dense rows can say that
+        pool_free(d.labels);
+        d.labels = 0;
+        d.y = make_matrix(n, k);
+        for(i = 0; i < n; ++i){
+            match_patterns(m, c->paths.line[i], set_label, d.y.data + (size_t)i*d.y.ld);
+        }
+    }
+    free_matcher(m);
+    free_lines(label_list);
+    d.cache = c;
+    return d;
+}
+
+// Make an image classification data set that decodes images as they are used
+// char *images: file with one image path per line
+// char *label_file: file with one label per line
+// int w, h: size to resize every image to, 0 to use the first image's size
+// size_t cache_bytes: most memory to spend on decoded images
+// returns: lazy data set, x holds no data of its own
+data load_image_classification_lazy(char *images, char *label_file, int w, int h, size_t cache_bytes)
+{
+    return make_lazy_data(images, label_file, w, h, cache_bytes, 0);
+}
+
+// Make an image classification data set that keeps every image file's
+// encoded bytes in memory and decodes the ones each batch uses
+// returns: compressed data set, x holds no data of its own
+data load_image_classification_compressed(char *images, char *label_file)
+{
+    return make_lazy_data(images, label_file, 0, 0, 0, 1);
+}
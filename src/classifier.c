@@ -3,6 +3,7 @@
 #include <assert.h>
 #include "uwnet.h"
 #include "matrix.h"
+#include "pool.h"
 
 int max_index(float *a, int n)
 {
@@ -21,13 +22,34 @@ int max_index(float *a, int n)
 
 float accuracy_net(net m, data d)
 {
-    matrix p = forward_net(m, d.x);
-    int i;
+    // 8-bit and lazy data gets converted a chunk at a time
+    int virtual = !has_float_examples(d);
+    int chunk = virtual ? 1024 : d.x.rows;
+    int i, start;
     int correct = 0;
-    for (i = 0; i < d.y.rows; ++i) {
-        if (max_index(d.y.data + i*d.y.cols, d.y.cols) == max_index(p.data + i*p.cols, p.cols)) ++correct;
+    int *ind = 0;
+    data b = {0};
+    if(virtual){
+        ind = calloc(chunk, sizeof(int));
+        b = make_batch(d, chunk);
     }
-    free_matrix(p);
+    for(start = 0; start < d.x.rows; start += chunk){
+        int n = (d.x.rows - start < chunk) ? d.x.rows - start : chunk;
+        data v = view_data(d, start, n);
+        if(virtual){
+            for(i = 0; i < n; ++i) ind[i] = start + i;
+            v = view_data(b, 0, n);
+            gather_batch(d, ind, v);
+        }
+        matrix p = forward_net(m, v.x);
+        for (i = 0; i < n; ++i) {
+            int truth = v.labels ? v.labels[i] : max_index(v.y.data + i*v.y.ld, v.y.cols);
+            if (truth == max_index(p.data + i*p.ld, p.cols)) ++correct;
+        }
+        free_matrix(p);
+    }
+    free_data(b);
+    free(ind);
     return (float)correct / d.y.rows;
 }
 
@@ -35,40 +57,100 @@ float cross_entropy_loss(matrix x, matrix y)
 {
     assert(x.rows == y.rows);
     assert(x.cols == y.cols);
-    int i;
+    int i, j;
     float sum = 0;
-    for(i = 0; i < y.cols*y.rows; ++i){
-        sum += -y.data[i]*log(x.data[i]);
+    for(i = 0; i < y.rows; ++i){
+        for(j = 0; j < y.cols; ++j){
+            sum += -y.data[i*y.ld + j]*log(x.data[i*x.ld + j]);
+        }
     }
     return sum/y.rows;
 }
 
+// Cross-entropy loss against class ids instead of one-hot rows
+// matrix x: predicted probabilities
+// int *labels: class of each row of x, negative for none
+float cross_entropy_loss_sparse(matrix x, int *labels)
+{
+    int i;
+    float sum = 0;
+    for(i = 0; i < x.rows; ++i){
+        if(labels[i] >= 0) sum += -log(x.data[i*x.ld + labels[i]]);
+    }
+    return sum/x.rows;
+}
+
+matrix cross_entropy_derivative_sparse(matrix x, int *labels)
+{
+    matrix d = copy_matrix(x);
+    int i;
+    for(i = 0; i < x.rows; ++i){
+        if(labels[i] >= 0) d.data[i*d.ld + labels[i]] -= 1;
+    }
+    return d;
+}
+
 matrix cross_entropy_derivative(matrix x, matrix y)
 {
     assert(x.rows == y.rows);
     assert(x.cols == y.cols);
     matrix d = make_matrix(x.rows, x.cols);
-    int i;
-    for(i = 0; i < y.cols*y.rows; ++i){
-        d.data[i] = x.data[i] - y.data[i];
+    int i, j;
+    for(i = 0; i < y.rows; ++i){
+        for(j = 0; j < y.cols; ++j){
+            d.data[i*d.ld + j] = x.data[i*x.ld + j] - y.data[i*y.ld + j];
+        }
     }
     return d;
 }
 
-void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay)
+// Run a batch forward and backward, adding its gradients into the net
+// void (*done)(int i, void *ctx): called as each layer's gradients are done
+// returns: average cross-entropy loss over the batch
+float batch_gradient_hook(net m, data b, void (*done)(int i, void *ctx), void *ctx)
+{
+    matrix yhat = forward_net(m, b.x);
+    float err;
+    matrix dy;
+    if(b.labels){
+        err = cross_entropy_loss_sparse(yhat, b.labels);
+        dy = cross_entropy_derivative_sparse(yhat, b.labels);
+    } else {
+        err = cross_entropy_loss(yhat, b.y);
+        dy = cross_entropy_derivative(yhat, b.y);
+    }
+    backward_net_hook(m, dy, done, ctx);
+    free_matrix(yhat);
+    free_matrix(dy);
+    return err;
+}
+
+float batch_gradient(net m, data b)
+{
+    return batch_gradient_hook(m, b, 0, 0);
+}
+
+static void train_from_loader(net m, loader *l, int batch, int iters, float rate, float momentum, float decay)
 {
-    srand(0);
     int e;
     for(e = 0; e < iters; ++e){
-        data b = random_batch(d, batch);
-        matrix yhat = forward_net(m, b.x);
-        float err = cross_entropy_loss(yhat, b.y);
-        matrix dy = cross_entropy_derivative(yhat, b.y);
+        data b = loader_next(l);
+        float err = batch_gradient(m, b);
         fprintf(stderr, "%06d: Loss: %f\n", e, err);
-        backward_net(m, dy);
         update_net(m, rate/batch, momentum, decay);
-        free_data(b);
-        free_matrix(yhat);
-        free_matrix(dy);
     }
+    stop_loader(l);
+}
+
+// Batches are seeded from rand(), so srand decides which ones are drawn
+void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay)
+{
+    train_from_loader(m, start_loader(d, batch, rand_seed()), batch, iters, rate, momentum, decay);
+}
+
+// Train on a stream of shards too big to load, memory use is set by the
+// stream's buffer rather than the size of the data set
+void train_image_classifier_stream(net m, stream *s, int batch, int iters, float rate, float momentum, float decay)
+{
+    train_from_loader(m, start_stream_loader(s, batch), batch, iters, rate, momentum, decay);
 }
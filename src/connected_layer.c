@@ -2,6 +2,31 @@
 #include <math.h>
 #include <assert.h>
 #include "uwnet.h"
+#include "parallel.h"
+
+typedef struct {
+    matrix m, b;
+} bias_args;
+
+static void add_bias_row(int i, void *ptr)
+{
+    bias_args *a = ptr;
+    int j;
+    float *yi = a->m.data + i*a->m.ld;
+    for(j = 0; j < a->m.cols; ++j){
+        yi[j] += a->b.data[j];
+    }
+}
+
+static void sum_bias_row(int i, float *db, void *ptr)
+{
+    bias_args *a = ptr;
+    int j;
+    const float *dyi = a->m.data + i*a->m.ld;
+    for(j = 0; j < a->m.cols; ++j){
+        db[j] += dyi[j];
+    }
+}
 
 // Add bias terms to a matrix
 // matrix xw: partially computed output of layer
@@ -13,12 +38,8 @@ matrix forward_bias(matrix xw, matrix b)
     assert(xw.cols == b.cols);
 
     matrix y = copy_matrix(xw);
-    int i,j;
-    for(i = 0; i < xw.rows; ++i){
-        for(j = 0; j < xw.cols; ++j){
-            y.data[i*y.cols + j] += b.data[j];
-        }
-    }
+    bias_args a = {y, b};
+    parallel_for(y.rows, add_bias_row, &a);
     return y;
 }
 
@@ -28,12 +49,8 @@ matrix forward_bias(matrix xw, matrix b)
 matrix backward_bias(matrix dy)
 {
     matrix db = make_matrix(1, dy.cols);
-    int i, j;
-    for(i = 0; i < dy.rows; ++i){
-        for(j = 0; j < dy.cols; ++j){
-            db.data[j] += dy.data[i*dy.cols + j];
-        }
-    }
+    bias_args a = {dy, db};
+    parallel_reduce(dy.rows, dy.cols, sum_bias_row, db.data, &a);
     return db;
 }
 
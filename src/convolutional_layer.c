@@ -3,6 +3,37 @@
 #include <assert.h>
 #include <string.h>
 #include "uwnet.h"
+#include "parallel.h"
+#include "pool.h"
+
+typedef struct {
+    matrix m, b;
+    int spatial;
+} bias_args;
+
+static void add_bias_row(int i, void *ptr)
+{
+    bias_args *a = ptr;
+    int j;
+    float *yi = a->m.data + i*a->m.ld;
+    for(j = 0; j < a->m.cols; ++j){
+        yi[j] += a->b.data[j/a->spatial];
+    }
+}
+
+static void sum_bias_row(int i, float *db, void *ptr)
+{
+    bias_args *a = ptr;
+    int j, k;
+    for(k = 0; k < a->b.cols; ++k){
+        const float *d = a->m.data + i*a->m.ld + k*a->spatial;
+        float sum = 0;
+        for(j = 0; j < a->spatial; ++j){
+            sum += d[j];
+        }
+        db[k] += sum;
+    }
+}
 
 // Add bias terms to a matrix
 // matrix xw: partially computed output of layer
@@ -14,13 +45,8 @@ matrix forward_convolutional_bias(matrix xw, matrix b)
     assert(xw.cols % b.cols == 0);
 
     matrix y = copy_matrix(xw);
-    int spatial = xw.cols / b.cols;
-    int i,j;
-    for(i = 0; i < y.rows; ++i){
-        for(j = 0; j < y.cols; ++j){
-            y.data[i*y.cols + j] += b.data[j/spatial];
-        }
-    }
+    bias_args a = {y, b, xw.cols / b.cols};
+    parallel_for(y.rows, add_bias_row, &a);
     return y;
 }
 
@@ -31,13 +57,8 @@ matrix backward_convolutional_bias(matrix dy, int n)
 {
     assert(dy.cols % n == 0);
     matrix db = make_matrix(1, n);
-    int spatial = dy.cols / n;
-    int i,j;
-    for(i = 0; i < dy.rows; ++i){
-        for(j = 0; j < dy.cols; ++j){
-            db.data[j/spatial] += dy.data[i*dy.cols + j];
-        }
-    }
+    bias_args a = {dy, db, dy.cols / n};
+    parallel_reduce(dy.rows, n, sum_bias_row, db.data, &a);
     return db;
 }
 
@@ -51,6 +72,34 @@ float get_pixel_value(image im, int row, int col, int channel, int paddingSize)
     return im.data[im.w*(row + im.h*channel) + col];
 }
 
+typedef struct {
+    image im;
+    matrix col;
+    int size, stride;
+    int outw, outh;
+    int paddingSize;
+} im2col_args;
+
+// Fill row k of the column matrix
+static void im2col_row(int k, void *ptr)
+{
+    im2col_args *a = ptr;
+    int i, j;
+    int size = a->size;
+    int curChannel = (k/size)/size;
+    int kernRowPos = k % size;
+    int kernColPos = (k/size) % size;
+
+    for (i = 0; i < a->outh; i++) {
+        for (j = 0; j < a->outw; j++) {
+            int imRow = (i*a->stride) + kernColPos;
+            int imCol = (j*a->stride) + kernRowPos;
+            int colInx = k*a->col.ld + i*a->outw + j;
+            a->col.data[colInx] = get_pixel_value(a->im, imRow - a->paddingSize, imCol - a->paddingSize, curChannel, a->paddingSize);
+        }
+    }
+}
+
 // Make a column matrix out of an image
 // image im: image to process
 // int size: kernel size for convolution operation
@@ -58,7 +107,7 @@ float get_pixel_value(image im, int row, int col, int channel, int paddingSize)
 // returns: column matrix
 matrix im2col(image im, int size, int stride)
 {
-    int i, j, k, paddingSize; //i = row, j = column, k = channel, paddingSize self explanatory
+    int paddingSize;
     int outw = (im.w-1)/stride + 1; //Adds 1 to account for integer division
     int outh = (im.h-1)/stride + 1; //Number of elements we look at for row and column
     int rows = im.c*size*size;
@@ -73,20 +122,10 @@ matrix im2col(image im, int size, int stride)
         paddingSize = size/2;
     }
 
-    for (k = 0; k < rows; k++) {
-        int curChannel = (k/size)/size;
-        int kernRowPos = k % size;
-        int kernColPos = (k/size) % size;
-
-        for (i = 0; i < outh; i++) {
-            for (j = 0; j < outw; j++) {
-                int imRow = (i*stride) + kernColPos;
-                int imCol = (j*stride) + kernRowPos;
-                int colInx = outw*((k*outh) + i) + j;
-                col.data[colInx] = get_pixel_value(im, imRow - paddingSize, imCol - paddingSize, curChannel, paddingSize);
-            }
-        }
-    }
+    // Inside a convolutional layer this runs per example already, so the
+    // rows are only split up when a single image comes through
+    im2col_args a = {im, col, size, stride, outw, outh, paddingSize};
+    parallel_for(rows, im2col_row, &a);
 
     return col;
 }
@@ -130,7 +169,7 @@ image col2im(int width, int height, int channels, matrix col, int size, int stri
             for (j = 0; j < outw; j++) {
                 int imRow = (i*stride) + kernColPos;
                 int imCol = (j*stride) + kernRowPos;
-                int colInx = outw*((k*outh) + i) + j;
+                int colInx = k*col.ld + i*outw + j;
                 float pixelVal = col.data[colInx];
                 set_pixel_value(im, imRow - paddingSize, imCol - paddingSize, curChannel, paddingSize, pixelVal);
             }
@@ -140,6 +179,55 @@ image col2im(int width, int height, int channels, matrix col, int size, int stri
     return im;
 }
 
+typedef struct {
+    layer l;
+    matrix in, out;
+    matrix dy, wt;
+    int outw, outh;
+} conv_args;
+
+// Convolve example i into row i of the output
+static void forward_example(int i, void *ptr)
+{
+    conv_args *a = ptr;
+    layer l = a->l;
+    int j;
+    image example = float_to_image(a->in.data + i*a->in.ld, l.width, l.height, l.channels);
+    matrix x = im2col(example, l.size, l.stride);
+    matrix wx = matmul(l.w, x);
+    for(j = 0; j < wx.rows; ++j){
+        memcpy(a->out.data + i*a->out.ld + j*wx.cols, wx.data + j*wx.ld, wx.cols*sizeof(float));
+    }
+    free_matrix(x);
+    free_matrix(wx);
+}
+
+// Add example i's dL/dw into dw and write its dL/dx into row i of out
+static void backward_example(int i, float *dw, void *ptr)
+{
+    conv_args *a = ptr;
+    layer l = a->l;
+    image example = float_to_image(a->in.data + i*a->in.ld, l.width, l.height, l.channels);
+
+    // Each row of dy is a filters x (outw*outh) matrix for one example
+    matrix dyi = float_to_matrix(a->dy.data + i*a->dy.ld, l.filters, a->outw*a->outh);
+
+    matrix x = im2col(example, l.size, l.stride);
+    matrix xt = transpose_matrix(x);
+    matrix dwi = matmul(dyi, xt);
+    axpy_matrix(1, dwi, float_to_matrix(dw, l.dw.rows, l.dw.cols));
+
+    matrix col = matmul(a->wt, dyi);
+    image dxi = col2im(l.width, l.height, l.channels, col, l.size, l.stride);
+    memcpy(a->out.data + i*a->out.ld, dxi.data, a->out.cols * sizeof(float));
+    free_matrix(col);
+
+    free_matrix(x);
+    free_matrix(xt);
+    free_matrix(dwi);
+    free_image(dxi);
+}
+
 // Run a convolutional layer on input
 // layer l: pointer to layer to run
 // matrix in: input to layer
@@ -152,20 +240,11 @@ matrix forward_convolutional_layer(layer l, matrix in)
     free_matrix(*l.x);
     *l.x = copy_matrix(in);
 
-    int i, j;
     int outw = (l.width-1)/l.stride + 1;
     int outh = (l.height-1)/l.stride + 1;
     matrix out = make_matrix(in.rows, outw*outh*l.filters);
-    for(i = 0; i < in.rows; ++i){
-        image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
-        matrix x = im2col(example, l.size, l.stride);
-        matrix wx = matmul(l.w, x);
-        for(j = 0; j < wx.rows*wx.cols; ++j){
-            out.data[i*out.cols + j] = wx.data[j];
-        }
-        free_matrix(x);
-        free_matrix(wx);
-    }
+    conv_args a = {l, in, out};
+    parallel_for(in.rows, forward_example, &a);
     matrix y = forward_convolutional_bias(out, l.b);
     free_matrix(out);
 
@@ -181,7 +260,6 @@ matrix backward_convolutional_layer(layer l, matrix dy)
     matrix in = *l.x;
     assert(in.cols == l.width*l.height*l.channels);
 
-    int i;
     int outw = (l.width-1)/l.stride + 1;
     int outh = (l.height-1)/l.stride + 1;
 
@@ -194,29 +272,13 @@ matrix backward_convolutional_layer(layer l, matrix dy)
     matrix dx = make_matrix(dy.rows, l.width*l.height*l.channels);
     matrix wt = transpose_matrix(l.w);
 
-    for(i = 0; i < in.rows; ++i){
-        image example = float_to_image(in.data + i*in.cols, l.width, l.height, l.channels);
-
-        dy.rows = l.filters;
-        dy.cols = outw*outh;
-
-        matrix x = im2col(example, l.size, l.stride);
-        matrix xt = transpose_matrix(x);
-        matrix dw = matmul(dy, xt);
-        axpy_matrix(1, dw, l.dw);
-
-        matrix col = matmul(wt, dy);
-        image dxi = col2im(l.width, l.height, l.channels, col, l.size, l.stride);
-        memcpy(dx.data + i*dx.cols, dxi.data, dx.cols * sizeof(float));
-        free_matrix(col);
-
-        free_matrix(x);
-        free_matrix(xt);
-        free_matrix(dw);
-        free_image(dxi);
-
-        dy.data = dy.data + dy.rows*dy.cols;
-    }
+    // Every thread sums dw for its examples on its own, the sums are
+    // added together once at the end
+    float *dw = pool_calloc((size_t)l.dw.rows*l.dw.cols, sizeof(float));
+    conv_args a = {l, in, dx, dy, wt, outw, outh};
+    parallel_reduce(in.rows, l.dw.rows*l.dw.cols, backward_example, dw, &a);
+    axpy_matrix(1, float_to_matrix(dw, l.dw.rows, l.dw.cols), l.dw);
+    pool_free(dw);
     free_matrix(wt);
     return dx;
 
@@ -2,92 +2,405 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "uwnet.h"
-#include "list.h"
+#include "pool.h"
+#include "matcher.h"
+#include "fileio.h"
 
-data random_batch(data d, int n)
+// Step a PCG32 generator
+// unsigned long long *state: generator state, updated in place
+// returns: 32 random bits
+unsigned int rand_next(unsigned long long *state)
 {
-    matrix x = {0};
-    matrix y = {0};
-    x.rows = y.rows = n;
-    x.cols = d.x.cols;
-    y.cols = d.y.cols;
-    x.data = calloc(n*x.cols, sizeof(float*));
-    y.data = calloc(n*y.cols, sizeof(float*));
-    int i, j;
-    for(i = 0; i < n; ++i){
-        int ind = rand()%d.x.rows;
-        for(j = 0; j < x.cols; ++j){
-            x.data[i*x.cols + j] = d.x.data[ind*x.cols + j];
+    unsigned long long old = *state;
+    *state = old*6364136223846793005ULL + 1442695040888963407ULL;
+    unsigned int xorshifted = ((old >> 18) ^ old) >> 27;
+    unsigned int rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+// Draw a uniform integer in [0, n) with no modulo bias
+// (Lemire's multiply and reject method)
+int rand_range(unsigned long long *state, int n)
+{
+    unsigned long long m = (unsigned long long)rand_next(state) * (unsigned int)n;
+    unsigned int low = (unsigned int)m;
+    if(low < (unsigned int)n){
+        unsigned int threshold = -(unsigned int)n % (unsigned int)n;
+        while(low < threshold){
+            m = (unsigned long long)rand_next(state) * (unsigned int)n;
+            low = (unsigned int)m;
         }
-        for(j = 0; j < y.cols; ++j){
-            y.data[i*y.cols + j] = d.y.data[ind*y.cols + j];
+    }
+    return m >> 32;
+}
+
+// Draw a seed from rand(), so srand still decides what a seeded
+// generator does
+unsigned long long rand_seed()
+{
+    return ((unsigned long long)rand() << 31) ^ rand();
+}
+
+static void shuffle(int *a, int n, unsigned long long *state)
+{
+    int i;
+    for(i = n-1; i > 0; --i){
+        int j = rand_range(state, i+1);
+        int swap = a[i];
+        a[i] = a[j];
+        a[j] = swap;
+    }
+}
+
+sampler make_sampler(int n, unsigned long long seed)
+{
+    sampler s = {0};
+    int i;
+    s.n = n;
+    s.order = calloc(n, sizeof(int));
+    for(i = 0; i < n; ++i) s.order[i] = i;
+    s.state = seed*2 + 1;
+    rand_next(&s.state);
+    shuffle(s.order, s.n, &s.state);
+    return s;
+}
+
+void free_sampler(sampler s)
+{
+    free(s.order);
+}
+
+static int compare_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Get the next n example indexes, reshuffling when an epoch runs out
+// sampler *s: sampler to draw from
+// int *ind: filled with n indexes
+void sample_indexes(sampler *s, int *ind, int n)
+{
+    int i;
+    for(i = 0; i < n; ++i){
+        if(s->pos == s->n){
+            shuffle(s->order, s->n, &s->state);
+            s->pos = 0;
+            ++s->epoch;
         }
+        ind[i] = s->order[s->pos++];
     }
-    data c;
-    c.x = x;
-    c.y = y;
-    return c;
+    // Gradients don't care about order within a batch, memory does
+    if(s->sorted) qsort(ind, n, sizeof(int), compare_ints);
 }
 
-list *get_lines(char *filename)
+data make_data(int n, int inputs, int outputs)
 {
-    char *path;
-    FILE *file = fopen(filename, "r");
-    if(!file) {
-        fprintf(stderr, "Couldn't open file %s\n", filename);
-        exit(0);
+    data d = {0};
+    d.x = make_matrix(n, inputs);
+    d.y = make_matrix(n, outputs);
+    return d;
+}
+
+// Make room for a batch of n examples from d
+// The batch has float inputs and the same kind of labels as d.
+data make_batch(data d, int n)
+{
+    data b = {0};
+    b.x = make_matrix(n, d.x.cols);
+    if(d.labels){
+        b.y = float_to_matrix(0, n, d.y.cols);
+        b.labels = pool_calloc(n, sizeof(int));
+    } else {
+        b.y = make_matrix(n, d.y.cols);
     }
-    list *lines = make_list();
-    while((path=fgetl(file))){
-        list_insert(lines, path);
+    return b;
+}
+
+// Convert bytes to floats, dst[i] = src[i]*scale + shift
+static void widen_bytes(unsigned char *src, float *dst, int n, float scale, float shift)
+{
+    int i = 0;
+#ifdef __AVX2__
+    __m256 s = _mm256_set1_ps(scale);
+    __m256 b = _mm256_set1_ps(shift);
+    for(; i + 8 <= n; i += 8){
+        __m128i v = _mm_loadl_epi64((__m128i *)(src + i));
+        __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(f, s), b));
+    }
+#endif
+    for(; i < n; ++i){
+        dst[i] = src[i]*scale + shift;
     }
-    fclose(file);
-    return lines;
 }
 
-data load_image_classification_data(char *images, char *label_file)
+// Write example i of d into dst as floats
+void example_to_floats(data d, int i, float *dst)
 {
-    list *image_list = get_lines(images);
-    list *label_list = get_lines(label_file);
-    int k = label_list->size;
-    char **labels = (char **)list_to_array(label_list);
+    if(d.cache){
+        cache_example(d.cache, d.first + i, dst);
+        return;
+    }
+    if(!d.bytes){
+        memcpy(dst, d.x.data + (size_t)i*d.x.ld, d.x.cols*sizeof(float));
+        return;
+    }
+    unsigned char *src = d.bytes + (size_t)i*d.x.cols;
+    if(d.channels <= 0){
+        widen_bytes(src, dst, d.x.cols, 1.f/255, 0);
+        return;
+    }
+    // Pixels are planar so each channel is one contiguous run
+    int c;
+    int spatial = d.x.cols / d.channels;
+    for(c = 0; c < d.channels; ++c){
+        float scale = 1.f/(255*d.std[c]);
+        float shift = -d.mean[c]/d.std[c];
+        widen_bytes(src + c*spatial, dst + c*spatial, spatial, scale, shift);
+    }
+}
+
+static void gather_label(data d, int j, data b, int i)
+{
+    if(d.labels){
+        b.labels[i] = d.labels[j];
+    } else {
+        memcpy(b.y.data + (size_t)i*b.y.ld, d.y.data + (size_t)j*d.y.ld, d.y.cols*sizeof(float));
+    }
+}
 
-    int n = image_list->size;
-    node *nd = image_list->front;
-    int cols = 0;
+// Copy examples from a data set into the rows of a batch
+// Examples that have to be decoded go to the cache together, so their
+// files are read at once and decoded across worker threads.
+// data d: examples to copy from
+// int *ind: which example goes in each row of b
+// data b: batch to fill, b.x.rows examples
+void gather_batch(data d, int *ind, data b)
+{
     int i;
-    int count = 0;
-    matrix x;
-    matrix y = make_matrix(n, k);
-    while(nd){
-        char *path = (char *)nd->val;
-        image im = load_image(path);
-        if (!cols) {
-            cols = im.w*im.h*im.c;
-            x = make_matrix(n, cols);
-        }
-        for (i = 0; i < cols; ++i){
-            x.data[count*x.cols + i] = im.data[i];
+    if(d.cache){
+        int *rows = calloc(b.x.rows, sizeof(int));
+        for(i = 0; i < b.x.rows; ++i) rows[i] = d.first + ind[i];
+        cache_batch(d.cache, rows, b.x.rows, b.x.data, b.x.ld);
+        free(rows);
+    } else {
+        for(i = 0; i < b.x.rows; ++i) example_to_floats(d, ind[i], b.x.data + (size_t)i*b.x.ld);
+    }
+    for(i = 0; i < b.x.rows; ++i) gather_label(d, ind[i], b, i);
+}
+
+// Normalize 8-bit data per channel as it is converted
+// int channels: number of channels, at most 4, 0 turns normalization off
+// float *mean, *std: mean and standard deviation of each channel in [0,1] units
+void normalize_data(data *d, int channels, float *mean, float *std)
+{
+    int c;
+    assert(channels >= 0 && channels <= 4);
+    assert(!channels || d->x.cols % channels == 0);
+    d->channels = channels;
+    for(c = 0; c < channels; ++c){
+        d->mean[c] = mean[c];
+        d->std[c] = std[c];
+    }
+}
+
+// Make a batch of n examples drawn with replacement
+// The draws are seeded from rand(), so srand still picks the batches.
+data random_batch(data d, int n)
+{
+    unsigned long long state = rand_seed();
+    data b = make_batch(d, n);
+    int *ind = calloc(n, sizeof(int));
+    int i;
+    for(i = 0; i < n; ++i){
+        ind[i] = rand_range(&state, d.x.rows);
+    }
+    gather_batch(d, ind, b);
+    free(ind);
+    return b;
+}
+
+data view_data(data d, int start, int n)
+{
+    data v = d;
+    v.x = view_rows(d.x, start, n);
+    v.y = view_rows(d.y, start, n);
+    if(d.bytes) v.bytes = d.bytes + (size_t)start*d.x.cols;
+    if(d.labels) v.labels = d.labels + start;
+    if(d.cache) v.first = d.first + start;
+    v.shallow = 1;
+    return v;
+}
+
+// Does x hold every example as floats, or are they made as batches are
+// (8-bit and lazy data sets)
+int has_float_examples(data d)
+{
+    return !d.bytes && !d.cache;
+}
+
+// Read the rest of a stream into one buffer with a terminator after it
+static char *read_all(int fd, size_t *size)
+{
+    size_t cap = 1<<16;
+    size_t n = 0;
+    char *buf = malloc(cap);
+    for(;;){
+        if(n + 1 == cap){
+            cap *= 2;
+            buf = realloc(buf, cap);
         }
+        ssize_t r = read(fd, buf + n, cap - n - 1);
+        if(r < 0) r = 0;
+        if(!r) break;
+        n += r;
+    }
+    buf[n] = 0;
+    *size = n;
+    return buf;
+}
 
-        for (i = 0; i < k; ++i){
-            if(strstr(path, labels[i])){
-                y.data[count*y.cols + i] = 1;
-            }
+// Read every line of a file without allocating anything per line
+// Regular files are mapped copy-on-write and split in place, anything
+// else is read into a single buffer. Lines are the same as fgetl gives.
+// char *filename: file to read
+// returns: lines, free with free_lines
+lines read_lines(char *filename)
+{
+    lines l = {0};
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "Couldn't open file %s\n", filename);
+        exit(0);
+    }
+    struct stat st;
+    size_t page = sysconf(_SC_PAGESIZE);
+    if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0){
+        l.size = st.st_size;
+        l.buf = mmap(0, l.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(l.buf == MAP_FAILED){
+            l.buf = 0;
+        } else if(l.buf[l.size-1] != '\n' && l.size % page == 0){
+            // No newline to overwrite and no zero filled tail of a page
+            // after the last line to terminate it, read it instead
+            munmap(l.buf, l.size);
+            l.buf = 0;
+        } else {
+            l.mapped = 1;
+            madvise(l.buf, l.size, MADV_SEQUENTIAL);
         }
-        ++count;
-        nd = nd->next;
-        free_image(im);
     }
+    if(!l.buf) l.buf = read_all(fd, &l.size);
+    close(fd);
+
+    char *p;
+    char *end = l.buf + l.size;
+    for(p = l.buf; p < end && (p = memchr(p, '\n', end - p)); ++p) ++l.n;
+    if(l.size && end[-1] != '\n') ++l.n;
+    l.line = calloc(l.n ? l.n : 1, sizeof(char *));
+    int i;
+    p = l.buf;
+    for(i = 0; i < l.n; ++i){
+        l.line[i] = p;
+        char *nl = memchr(p, '\n', end - p);
+        if(!nl) break;
+        *nl = 0;
+        p = nl + 1;
+    }
+    return l;
+}
 
-    free_list(image_list);
-    free_list(label_list);
-    free(labels);
+void free_lines(lines l)
+{
+    if(l.mapped) munmap(l.buf, l.size);
+    else free(l.buf);
+    free(l.line);
+}
 
+typedef struct {
+    char **paths;
+    matcher *labels;
+    image shape;
     data d;
-    d.x = x;
-    d.y = y;
+    atomic_int failed;
+} load_args;
+
+static void set_label(int j, void *row)
+{
+    ((float *)row)[j] = 1;
+}
+
+// Decode one image straight into its row of x and fill in its labels
+static void load_example(int i, unsigned char *buf, size_t size, void *ptr)
+{
+    load_args *a = ptr;
+    image s = a->shape;
+    if(!buf) fprintf(stderr, "Couldn't read file %s\n", a->paths[i]);
+    if(!buf || !load_image_memory_into(buf, size, a->paths[i], a->d.x.data + (size_t)i*a->d.x.ld, s.w, s.h, s.c)){
+        atomic_store(&a->failed, 1);
+        return;
+    }
+    match_patterns(a->labels, a->paths[i], set_label, a->d.y.data + (size_t)i*a->d.y.ld);
+}
+
+static void first_label(int j, void *first)
+{
+    int *f = first;
+    if(*f < 0 || j < *f) *f = j;
+}
+
+// Find which labels appear in a path
+// matcher *labels: matcher built from the label list
+// int *first: set to the first label found, -1 if there are none
+// returns: number of labels found
+int find_labels(matcher *labels, char *path, int *first)
+{
+    *first = -1;
+    return match_patterns(labels, path, first_label, first);
+}
+
+data load_image_classification_data(char *images, char *label_file)
+{
+    data d = {0};
+    char pack[4096];
+    snprintf(pack, sizeof(pack), "%s.pack", images);
+    if(load_packed_data(pack, images, label_file, &d)) return d;
+
+    lines image_list = read_lines(images);
+    lines label_list = read_lines(label_file);
+    int k = label_list.n;
+    int n = image_list.n;
+    char **labels = label_list.line;
+    char **paths = image_list.line;
+
+    if(n){
+        // The first image tells us how big every row is
+        image im = load_image(paths[0]);
+        load_args a = {paths, make_matcher(labels, k), im};
+        atomic_init(&a.failed, 0);
+        d = make_data(n, im.w*im.h*im.c, k);
+        a.d = d;
+        free_image(im);
+        process_files(paths, n, load_example, &a);
+        free_matcher(a.labels);
+        if(atomic_load(&a.failed)){
+            fprintf(stderr, "Couldn't load image data from %s\n", images);
+            exit(0);
+        }
+    }
+
+    free_lines(image_list);
+    free_lines(label_list);
     return d;
 }
 
@@ -128,8 +441,16 @@ char *fgetl(FILE *fp)
 
 void free_data(data d)
 {
+    if(d.shallow) return;
     free_matrix(d.x);
     free_matrix(d.y);
+    free_image_cache(d.cache);
+    if(d.map){
+        munmap(d.map, d.map_size);
+    } else {
+        pool_free(d.bytes);
+        pool_free(d.labels);
+    }
 }
 
 
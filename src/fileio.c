@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+#include "fileio.h"
+#include "parallel.h"
+
+// Files in flight at once through io_uring
+#define URING_DEPTH 64
+// Files read before handing them to process_files workers, the next
+// chunk is read while they work
+#define PROCESS_CHUNK 1024
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned pending;
+} ring;
+
+// A file being read: opened, then sized, then read until it's all in
+enum {OPENING, SIZING, READING};
+typedef struct {
+    int index;
+    int stage;
+    int fd;
+    struct statx st;
+    unsigned char *buf;
+    size_t size, got;
+} file_read;
+
+static int setup_ring(ring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd < 0) return 0;
+
+    // Only use the ring if it can do every step of reading a file
+    int ok = 1;
+    size_t probe_size = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) < 0) ok = 0;
+    int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ};
+    int i;
+    for(i = 0; ok && i < 3; ++i){
+        if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+    }
+    free(probe);
+    if(!ok){
+        close(r->fd);
+        return 0;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = 0;
+    }
+    r->sq_ptr = mmap(0, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = r->sq_ptr;
+    if(r->cq_len && r->sq_ptr != MAP_FAILED){
+        r->cq_ptr = mmap(0, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(0, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED){
+        if(r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+        if(r->cq_len && r->cq_ptr != MAP_FAILED) munmap(r->cq_ptr, r->cq_len);
+        if(r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+        close(r->fd);
+        return 0;
+    }
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+static void free_ring(ring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if(r->cq_len) munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+// Queue the next step for a file, submitted on the next io_uring_enter
+static void queue_step(ring *r, file_read *f, char *path)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = r->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    if(f->stage == OPENING){
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)path;
+        sqe->open_flags = O_RDONLY;
+    } else if(f->stage == SIZING){
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = f->fd;
+        sqe->addr = (unsigned long)"";
+        sqe->statx_flags = AT_EMPTY_PATH;
+        sqe->len = STATX_SIZE;
+        sqe->off = (unsigned long)&f->st;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = f->fd;
+        sqe->addr = (unsigned long)(f->buf + f->got);
+        sqe->len = (f->size - f->got > (1u<<30)) ? (1u<<30) : f->size - f->got;
+        sqe->off = f->got;
+    }
+    sqe->user_data = (unsigned long)f;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->pending;
+}
+
+static int read_files_uring(ring *r, char **paths, int n,
+        void (*done)(int i, unsigned char *buf, size_t size, void *ctx), void *ctx)
+{
+    file_read files[URING_DEPTH];
+    file_read *idle[URING_DEPTH];
+    int nidle = URING_DEPTH;
+    int next = 0;
+    int finished = 0;
+    int failed = 0;
+    int i;
+    for(i = 0; i < URING_DEPTH; ++i) idle[i] = files + i;
+
+    while(finished < n){
+        while(nidle && next < n){
+            file_read *f = idle[--nidle];
+            memset(f, 0, sizeof(*f));
+            f->index = next++;
+            f->stage = OPENING;
+            f->fd = -1;
+            queue_step(r, f, paths[f->index]);
+        }
+        long submitted = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        if(submitted < 0){
+            if(errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            perror("io_uring_enter");
+            exit(-1);
+        }
+        r->pending -= submitted;
+
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; ++head){
+            struct io_uring_cqe *cqe = r->cqes + (head & *r->cq_mask);
+            file_read *f = (file_read *)(unsigned long)cqe->user_data;
+            int res = cqe->res;
+            int finish = 0;
+            if(res < 0 || (f->stage == READING && res == 0)){
+                finish = 1;
+            } else if(f->stage == OPENING){
+                f->fd = res;
+                f->stage = SIZING;
+                queue_step(r, f, 0);
+            } else if(f->stage == SIZING){
+                f->size = f->st.stx_size;
+                f->buf = malloc(f->size ? f->size : 1);
+                f->stage = READING;
+                if(f->size) queue_step(r, f, 0);
+                else finish = 1;
+            } else {
+                f->got += res;
+                if(f->got < f->size) queue_step(r, f, 0);
+                else finish = 1;
+            }
+            if(finish){
+                if(f->fd >= 0) close(f->fd);
+                if(f->stage != READING || f->got < f->size){
+                    free(f->buf);
+                    f->buf = 0;
+                    ++failed;
+                }
+                done(f->index, f->buf, f->buf ? f->size : 0, ctx);
+                idle[nidle++] = f;
+                ++finished;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return failed;
+}
+
+typedef struct {
+    char **paths;
+    void (*done)(int i, unsigned char *buf, size_t size, void *ctx);
+    void *ctx;
+    atomic_int failed;
+} pool_args;
+
+static void read_one(int i, void *ptr)
+{
+    pool_args *a = ptr;
+    unsigned char *buf = 0;
+    size_t got = 0;
+    struct stat st;
+    int fd = open(a->paths[i], O_RDONLY);
+    if(fd >= 0 && !fstat(fd, &st)){
+        size_t size = st.st_size;
+        buf = malloc(size ? size : 1);
+        while(got < size){
+            ssize_t r = pread(fd, buf + got, size - got, got);
+            if(r <= 0) break;
+            got += r;
+        }
+        if(got < size){
+            free(buf);
+            buf = 0;
+        }
+    }
+    if(fd >= 0) close(fd);
+    if(!buf) atomic_fetch_add(&a->failed, 1);
+    a->done(i, buf, buf ? got : 0, a->ctx);
+}
+
+int read_files(char **paths, int n, void (*done)(int i, unsigned char *buf, size_t size, void *ctx), void *ctx)
+{
+    ring r;
+    if(n > 0 && !getenv("UWNET_NO_URING") && setup_ring(&r, URING_DEPTH)){
+        int failed = read_files_uring(&r, paths, n, done, ctx);
+        free_ring(&r);
+        return failed;
+    }
+    pool_args a = {paths, done, ctx};
+    atomic_init(&a.failed, 0);
+    parallel_for(n, read_one, &a);
+    return atomic_load(&a.failed);
+}
+
+// One chunk of process_files, read on a background thread while the
+// chunk before it is decoded
+typedef struct {
+    char **paths;
+    int start, count;
+    unsigned char **bufs;
+    size_t *sizes;
+    void (*fn)(int i, unsigned char *buf, size_t size, void *ctx);
+    void *ctx;
+    pthread_t thread;
+    int threaded;
+} process_args;
+
+static void keep_file(int i, unsigned char *buf, size_t size, void *ptr)
+{
+    process_args *a = ptr;
+    a->bufs[i] = buf;
+    a->sizes[i] = size;
+}
+
+static void *read_chunk(void *ptr)
+{
+    process_args *a = ptr;
+    read_files(a->paths + a->start, a->count, keep_file, a);
+    return 0;
+}
+
+// Start reading the chunk of files from start
+// The first chunk is read right away since there is nothing to overlap it
+// with, later ones on their own thread.
+static void start_chunk(process_args *a, int start, int n)
+{
+    a->start = start;
+    a->count = (n - start < PROCESS_CHUNK) ? n - start : PROCESS_CHUNK;
+    a->threaded = start && !pthread_create(&a->thread, 0, read_chunk, a);
+    if(!a->threaded) read_chunk(a);
+}
+
+static void process_one(int i, void *ptr)
+{
+    process_args *a = ptr;
+    a->fn(a->start + i, a->bufs[i], a->sizes[i], a->ctx);
+    free(a->bufs[i]);
+}
+
+void process_files(char **paths, int n, void (*fn)(int i, unsigned char *buf, size_t size, void *ctx), void *ctx)
+{
+    int k;
+    int size = (n < PROCESS_CHUNK) ? n : PROCESS_CHUNK;
+    process_args a[2] = {{0}};
+    if(n <= 0) return;
+    for(k = 0; k < 2; ++k){
+        a[k].paths = paths;
+        a[k].bufs = calloc(size, sizeof(unsigned char *));
+        a[k].sizes = calloc(size, sizeof(size_t));
+        a[k].fn = fn;
+        a[k].ctx = ctx;
+    }
+    start_chunk(&a[0], 0, n);
+    for(k = 0; ; k ^= 1){
+        process_args *cur = &a[k];
+        if(cur->threaded) pthread_join(cur->thread, 0);
+        int next = cur->start + cur->count;
+        if(next < n) start_chunk(&a[k^1], next, n);
+        parallel_for(cur->count, process_one, cur);
+        if(next >= n) break;
+    }
+    for(k = 0; k < 2; ++k){
+        free(a[k].bufs);
+        free(a[k].sizes);
+    }
+}
@@ -0,0 +1,32 @@
+// Include guards and C++ compatibility
+#ifndef FILEIO_H
+#define FILEIO_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Read whole files into memory with many reads in flight at once
+// Uses io_uring when the kernel allows it, otherwise a pool of threads
+// doing blocking reads. Setting UWNET_NO_URING in the environment forces
+// the thread pool.
+// char **paths: files to read
+// int n: number of files
+// void (*done)(int i, unsigned char *buf, size_t size, void *ctx):
+//     called once per file as soon as it has been read, possibly from
+//     several threads at once. buf is 0 if the file couldn't be read,
+//     otherwise the callee owns it and frees it with free.
+// void *ctx: passed through to done
+// returns: number of files that couldn't be read
+int read_files(char **paths, int n, void (*done)(int i, unsigned char *buf, size_t size, void *ctx), void *ctx);
+
+// Read files a chunk at a time with read_files and hand each one's bytes
+// to fn(i, buf, size, ctx) on worker threads. The next chunk is read
+// while the workers are on this one. The buffers are freed after fn
+// returns, buf is 0 for files that couldn't be read.
+void process_files(char **paths, int n, void (*fn)(int i, unsigned char *buf, size_t size, void *ctx), void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
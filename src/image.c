@@ -3,8 +3,12 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "image.h"
+#include "pool.h"
 
 image float_to_image(float *data, int w, int h, int c)
 {
@@ -29,7 +33,7 @@ image make_empty_image(int w, int h, int c)
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = pool_calloc(h*w*c, sizeof(float));
     return out;
 }
 
@@ -78,6 +82,77 @@ void save_image(image im, const char *name)
     save_image_options(im, name, JPG, 80);
 }
 
+#ifdef __AVX2__
+// Look up 8 bytes in lut and write them as floats
+static inline void store_unit8(float *dst, const float *lut, __m128i bytes)
+{
+    _mm256_storeu_ps(dst, _mm256_i32gather_ps(lut, _mm256_cvtepu8_epi32(bytes), 4));
+}
+
+// Write the first keep groups of 8 bytes in v to planes n floats apart
+static inline void store_planes(float *dst, const float *lut, int n, __m256i v, int keep)
+{
+    long long planes[4];
+    int k;
+    _mm256_storeu_si256((__m256i *)planes, v);
+    for(k = 0; k < keep; ++k){
+        store_unit8(dst + k*n, lut, _mm_cvtsi64_si128(planes[k]));
+    }
+}
+#endif
+
+// Convert interleaved bytes from stb into planar floats in [0,1]
+// Reads the source once in order, splitting 8 pixels at a time into
+// their channels with byte shuffles, then looks the values up in a table
+// so every path gives exactly b/255.
+// unsigned char *data: w*h*c interleaved bytes
+// int keep: number of channels to write, later channels are dropped
+// float *dst: room for w*h*keep floats
+static void bytes_to_planar(unsigned char *data, int w, int h, int c, int keep, float *dst)
+{
+    int i, k;
+    int n = w*h;
+    float lut[256];
+    for(i = 0; i < 256; ++i) lut[i] = (float)i/255.;
+    i = 0;
+#ifdef __AVX2__
+    // After the shuffle each lane is RRRRGGGGBBBBAAAA for its 4 pixels,
+    // the permute then puts each channel's 8 bytes next to each other
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    if(c == 1){
+        for(; i + 8 <= n; i += 8){
+            store_unit8(dst + i, lut, _mm_loadl_epi64((__m128i *)(data + i)));
+        }
+    } else if(c == 3){
+        const __m256i split = _mm256_setr_epi8(
+                0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1,
+                0, 3, 6, 9, 1, 4, 7, 10, 2, 5, 8, 11, -1, -1, -1, -1);
+        // Each load reads 4 bytes past the 8 pixels it uses
+        for(; (i + 8)*3 + 4 <= n*3; i += 8){
+            unsigned char *p = data + i*3;
+            __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((__m128i *)p)), _mm_loadu_si128((__m128i *)(p + 12)), 1);
+            v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, split), order);
+            store_planes(dst + i, lut, n, v, keep);
+        }
+    } else if(c == 4){
+        const __m256i split = _mm256_setr_epi8(
+                0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+                0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        for(; i + 8 <= n; i += 8){
+            __m256i v = _mm256_loadu_si256((__m256i *)(data + i*4));
+            v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, split), order);
+            store_planes(dst + i, lut, n, v, keep);
+        }
+    }
+#endif
+    for(; i < n; ++i){
+        for(k = 0; k < keep; ++k){
+            dst[k*n + i] = lut[data[i*c + k]];
+        }
+    }
+}
+
 // 
 // Load an image using stb
 // channels = [0..4]
@@ -93,23 +168,142 @@ image load_image_stb(char *filename, int channels)
         exit(0);
     }
     if (channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
     //We don't like alpha channels, #YOLO
-    if(im.c == 4) im.c = 3;
+    int keep = (c == 4) ? 3 : c;
+    image im = make_image(w, h, keep);
+    bytes_to_planar(data, w, h, c, keep, im.data);
     free(data);
     return im;
 }
 
+// Decode an encoded image (PNG, JPEG, ...) that is already in memory
+// unsigned char *buf: the file's bytes
+// int size: length of buf
+// int channels: like load_image_stb
+image load_image_memory(unsigned char *buf, int size, int channels)
+{
+    int w, h, c;
+    unsigned char *data = stbi_load_from_memory(buf, size, &w, &h, &c, channels);
+    if (!data) {
+        fprintf(stderr, "Cannot decode image from memory\nSTB Reason: %s\n",
+            stbi_failure_reason());
+        exit(0);
+    }
+    if (channels) c = channels;
+    int keep = (c == 4) ? 3 : c;
+    image im = make_image(w, h, keep);
+    bytes_to_planar(data, w, h, c, keep, im.data);
+    free(data);
+    return im;
+}
+
+static image resize_to(image im, int w, int h)
+{
+    if(im.w == w && im.h == h) return im;
+    image r = bilinear_resize(im, w, h);
+    free_image(im);
+    return r;
+}
+
+// Load an image and resize it to w x h
+// JPEGs are decoded straight to the smallest of 1/2, 1/4 or 1/8 scale
+// that is still at least w x h, so only a small resize is left to do.
+// int channels: like load_image_stb
+image load_image_scaled(char *filename, int channels, int w, int h)
+{
+    stbi_set_jpeg_min_size(w, h);
+    image im = load_image_stb(filename, channels);
+    stbi_set_jpeg_min_size(0, 0);
+    return resize_to(im, w, h);
+}
+
+// Same as load_image_scaled for a file that is already in memory
+image load_image_memory_scaled(unsigned char *buf, int size, int channels, int w, int h)
+{
+    stbi_set_jpeg_min_size(w, h);
+    image im = load_image_memory(buf, size, channels);
+    stbi_set_jpeg_min_size(0, 0);
+    return resize_to(im, w, h);
+}
+
+int load_image_into(char *filename, float *dst, int w, int h, int c)
+{
+    int iw, ih, ic;
+    unsigned char *data = stbi_load(filename, &iw, &ih, &ic, c);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        return 0;
+    }
+    if (iw != w || ih != h) {
+        fprintf(stderr, "Image \"%s\" is %dx%d, expected %dx%d\n", filename, iw, ih, w, h);
+        free(data);
+        return 0;
+    }
+    bytes_to_planar(data, w, h, c, c, dst);
+    free(data);
+    return 1;
+}
+
+// Split interleaved bytes into planes, keeping them as bytes
+// unsigned char *data: w*h*c interleaved bytes
+// int keep: number of channels to write, later channels are dropped
+// unsigned char *dst: room for w*h*keep bytes
+static void bytes_to_planar_bytes(unsigned char *data, int w, int h, int c, int keep, unsigned char *dst)
+{
+    int i, k;
+    int n = w*h;
+    for(k = 0; k < keep; ++k){
+        unsigned char *plane = dst + (size_t)k*n;
+        for(i = 0; i < n; ++i){
+            plane[i] = data[i*c + k];
+        }
+    }
+}
+
+// Decode an encoded image in memory to interleaved bytes of a known size
+// returns: stb buffer to free, 0 on failure (after printing why)
+static unsigned char *decode_memory_sized(unsigned char *buf, size_t size, const char *name, int w, int h, int c)
+{
+    int iw, ih, ic;
+    unsigned char *data = stbi_load_from_memory(buf, size, &iw, &ih, &ic, c);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            name, stbi_failure_reason());
+        return 0;
+    }
+    if (iw != w || ih != h) {
+        fprintf(stderr, "Image \"%s\" is %dx%d, expected %dx%d\n", name, iw, ih, w, h);
+        free(data);
+        return 0;
+    }
+    return data;
+}
+
+// Decode an encoded image in memory straight into planar floats
+// Same as load_image_into but for a file that has already been read.
+// const char *name: used in error messages
+int load_image_memory_into(unsigned char *buf, size_t size, const char *name, float *dst, int w, int h, int c)
+{
+    unsigned char *data = decode_memory_sized(buf, size, name, w, h, c);
+    if (!data) return 0;
+    bytes_to_planar(data, w, h, c, c, dst);
+    free(data);
+    return 1;
+}
+
+// Decode an encoded image in memory straight into planar bytes
+// Same as load_image_memory_into but keeps stb's 0-255 values.
+// unsigned char *dst: room for w*h*c bytes
+int load_image_memory_into_bytes(unsigned char *buf, size_t size, const char *name, unsigned char *dst, int w, int h, int c)
+{
+    unsigned char *data = decode_memory_sized(buf, size, name, w, h, c);
+    if (!data) return 0;
+    bytes_to_planar_bytes(data, w, h, c, c, dst);
+    free(data);
+    return 1;
+}
+
 image load_image(char *filename)
 {
     image out = load_image_stb(filename, 0);
@@ -118,7 +312,7 @@ image load_image(char *filename)
 
 void free_image(image im)
 {
-    free(im.data);
+    pool_free(im.data);
 }
 
 float nn_interpolate(image im, float x, float y, int c)
@@ -144,22 +338,129 @@ float bilinear_interpolate(image im, float x, float y, int c)
     return v;
 }
 
-image bilinear_resize(image im, int w, int h)
+// Which source pixels feed each output pixel along one axis, and how much
+// Output i is the sum over t < n of src[first[i] + t]*weight[t*dst + i].
+typedef struct {
+    int n;
+    int *first;
+    float *weight;
+} resample_taps;
+
+// Work out the taps for resizing one axis from src to dst pixels
+// Shrinking by 2x or more averages the area each output pixel covers so
+// fine detail doesn't alias, otherwise it's bilinear with clamped edges.
+static resample_taps make_resample_taps(int src, int dst)
 {
-    image r = make_image(w, h, im.c);   
-    float xscale = (float)im.w/w;
-    float yscale = (float)im.h/h;
-    int i, j, k;
-    for(k = 0; k < im.c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                float y = (j+.5)*yscale - .5;
-                float x = (i+.5)*xscale - .5;
-                float val = bilinear_interpolate(im, x, y, k);
-                set_pixel(r, i, j, k, val);
+    int i, t;
+    resample_taps r;
+    double scale = (double)src/dst;
+    if(scale >= 2) r.n = (int)ceil(scale) + 1;
+    else r.n = 2;
+    if(r.n > src) r.n = src;
+    r.first = calloc(dst, sizeof(int));
+    r.weight = calloc(r.n*dst, sizeof(float));
+    for(i = 0; i < dst; ++i){
+        if(scale >= 2){
+            double lo = i*scale;
+            double hi = (i+1)*scale;
+            int first = (int)lo;
+            if(first > src - r.n) first = src - r.n;
+            r.first[i] = first;
+            for(t = 0; t < r.n; ++t){
+                double a = first + t > lo ? first + t : lo;
+                double b = first + t + 1 < hi ? first + t + 1 : hi;
+                if(b > a) r.weight[t*dst + i] = (b - a)/scale;
+            }
+        } else if(r.n == 1){
+            r.first[i] = 0;
+            r.weight[i] = 1;
+        } else {
+            double x = (i + .5)*scale - .5;
+            int lx = (int)floor(x);
+            float dx = x - lx;
+            if(lx < 0){
+                r.first[i] = 0;
+                r.weight[i] = 1;
+            } else if(lx >= src - 1){
+                r.first[i] = src - 2;
+                r.weight[dst + i] = 1;
+            } else {
+                r.first[i] = lx;
+                r.weight[i] = 1 - dx;
+                r.weight[dst + i] = dx;
+            }
+        }
+    }
+    return r;
+}
+
+static void free_resample_taps(resample_taps r)
+{
+    free(r.first);
+    free(r.weight);
+}
+
+// Resample every row of a plane of rows along x
+static void resample_rows(float *src, int sw, float *dst, int dw, int rows, resample_taps r)
+{
+    int i, j, t;
+    for(j = 0; j < rows; ++j){
+        float *s = src + (size_t)j*sw;
+        float *d = dst + (size_t)j*dw;
+        i = 0;
+#ifdef __AVX2__
+        for(; i + 8 <= dw; i += 8){
+            __m256i idx = _mm256_loadu_si256((__m256i *)(r.first + i));
+            __m256 sum = _mm256_setzero_ps();
+            for(t = 0; t < r.n; ++t){
+                __m256 v = _mm256_i32gather_ps(s + t, idx, 4);
+                sum = _mm256_add_ps(sum, _mm256_mul_ps(v, _mm256_loadu_ps(r.weight + t*dw + i)));
             }
+            _mm256_storeu_ps(d + i, sum);
+        }
+#endif
+        for(; i < dw; ++i){
+            float sum = 0;
+            for(t = 0; t < r.n; ++t) sum += s[r.first[i] + t]*r.weight[t*dw + i];
+            d[i] = sum;
+        }
+    }
+}
+
+// Resample one plane along y, blending whole rows at a time
+static void resample_cols(float *src, float *dst, int w, int dh, resample_taps r)
+{
+    int i, j, t;
+    for(j = 0; j < dh; ++j){
+        float *restrict d = dst + (size_t)j*w;
+        for(i = 0; i < w; ++i) d[i] = 0;
+        for(t = 0; t < r.n; ++t){
+            float wt = r.weight[t*dh + j];
+            if(wt == 0) continue;
+            const float *restrict s = src + (size_t)(r.first[j] + t)*w;
+            for(i = 0; i < w; ++i) d[i] += wt*s[i];
         }
     }
+}
+
+// Resize an image, bilinear when growing or shrinking a little and
+// averaging over area when shrinking by 2x or more
+// Done in two separable passes, the taps for each row and column are
+// worked out once and shared by every channel.
+image bilinear_resize(image im, int w, int h)
+{
+    int k;
+    image r = make_image(w, h, im.c);
+    resample_taps xt = make_resample_taps(im.w, w);
+    resample_taps yt = make_resample_taps(im.h, h);
+    float *tmp = pool_calloc((size_t)w*im.h*im.c, sizeof(float));
+    resample_rows(im.data, im.w, tmp, w, im.h*im.c, xt);
+    for(k = 0; k < im.c; ++k){
+        resample_cols(tmp + (size_t)k*w*im.h, r.data + (size_t)k*w*h, w, h, yt);
+    }
+    pool_free(tmp);
+    free_resample_taps(xt);
+    free_resample_taps(yt);
     return r;
 }
 
@@ -33,6 +33,13 @@ image make_random_image(int w, int h, int c, float s);
 image make_image(int w, int h, int c);
 image float_to_image(float *data, int w, int h, int c);
 image load_image(char *filename);
+image load_image_stb(char *filename, int channels);
+image load_image_memory(unsigned char *buf, int size, int channels);
+image load_image_scaled(char *filename, int channels, int w, int h);
+image load_image_memory_scaled(unsigned char *buf, int size, int channels, int w, int h);
+int load_image_into(char *filename, float *dst, int w, int h, int c);
+int load_image_memory_into(unsigned char *buf, size_t size, const char *name, float *dst, int w, int h, int c);
+int load_image_memory_into_bytes(unsigned char *buf, size_t size, const char *name, unsigned char *dst, int w, int h, int c);
 void save_image_options(image im, const char *name, IMAGE_TYPE f, int quality);
 void save_image(image im, const char *name);
 void free_image(image im);
@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "uwnet.h"
+
+// Number of batches in the ring: the one being trained on plus two ahead
+#define LOADER_SLOTS 3
+
+// Single producer, single consumer ring of batches. The producer thread
+// owns slots [head+1, tail) while filling, the consumer owns slot head
+// until it asks for the next batch. Indexes only ever increase.
+struct loader{
+    data d;
+    stream *stream;
+    int batch;
+    sampler s;
+    unsigned long long jitter;
+    int *ind;
+    data slots[LOADER_SLOTS];
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int stop;
+    atomic_int failed;
+    int started;
+    pthread_t thread;
+};
+
+// Wait a little longer each time we are called so a blocked thread
+// doesn't eat a core while the other side is busy
+static void backoff(int *spins)
+{
+    if(*spins < 64){
+        ++*spins;
+    } else if(*spins < 128){
+        ++*spins;
+        sched_yield();
+    } else {
+        struct timespec ts = {0, 50000};
+        nanosleep(&ts, 0);
+    }
+}
+
+static void *loader_thread(void *ptr)
+{
+    loader *l = ptr;
+    while(!atomic_load_explicit(&l->stop, memory_order_relaxed)){
+        unsigned tail = atomic_load_explicit(&l->tail, memory_order_relaxed);
+        int spins = 0;
+        while(tail - atomic_load_explicit(&l->head, memory_order_acquire) == LOADER_SLOTS){
+            if(atomic_load_explicit(&l->stop, memory_order_relaxed)) return 0;
+            backoff(&spins);
+        }
+        data b = l->slots[tail % LOADER_SLOTS];
+        if(l->stream){
+            if(!stream_batch(l->stream, b)){
+                atomic_store(&l->failed, 1);
+                return 0;
+            }
+            atomic_store_explicit(&l->tail, tail + 1, memory_order_release);
+            continue;
+        }
+        sample_indexes(&l->s, l->ind, l->batch);
+        if(l->d.aug.w) augment_batch(l->d, l->ind, b, &l->jitter);
+        else gather_batch(l->d, l->ind, b);
+        atomic_store_explicit(&l->tail, tail + 1, memory_order_release);
+    }
+    return 0;
+}
+
+static void run_loader(loader *l, data format)
+{
+    int i;
+    for(i = 0; i < LOADER_SLOTS; ++i){
+        l->slots[i] = make_batch(format, l->batch);
+    }
+    // Slot 0 is handed out first, so pretend the consumer holds slot -1
+    atomic_init(&l->head, (unsigned)-1);
+    atomic_init(&l->tail, 0);
+    atomic_init(&l->stop, 0);
+    atomic_init(&l->failed, 0);
+    if(pthread_create(&l->thread, 0, loader_thread, l)){
+        fprintf(stderr, "Couldn't start loader thread\n");
+        exit(-1);
+    }
+    l->started = 1;
+}
+
+// Start assembling batches in the background
+// data d: data set to sample from
+// int batch: examples per batch
+// unsigned long long seed: seed for the sampler, same seed gives the same batches
+// returns: loader to pull batches from with loader_next
+loader *start_loader(data d, int batch, unsigned long long seed)
+{
+    loader *l = calloc(1, sizeof(loader));
+    l->d = d;
+    l->batch = batch;
+    l->s = make_sampler(d.x.rows, seed);
+    l->s.sorted = 1;
+    l->jitter = seed ^ 0x9e3779b97f4a7c15ULL;
+    l->ind = calloc(batch, sizeof(int));
+    run_loader(l, d);
+    return l;
+}
+
+// Start assembling batches from a stream in the background
+// The stream is still owned by the caller, close it after stop_loader.
+loader *start_stream_loader(stream *s, int batch)
+{
+    loader *l = calloc(1, sizeof(loader));
+    l->stream = s;
+    l->batch = batch;
+    run_loader(l, stream_format(s));
+    return l;
+}
+
+// Get the next batch, waiting if the loader hasn't finished it yet
+// The batch belongs to the loader and is only valid until the next call.
+data loader_next(loader *l)
+{
+    unsigned head = atomic_load_explicit(&l->head, memory_order_relaxed) + 1;
+    // Hand the previous batch back to the producer
+    atomic_store_explicit(&l->head, head, memory_order_release);
+    int spins = 0;
+    while(atomic_load_explicit(&l->tail, memory_order_acquire) == head){
+        if(atomic_load(&l->failed)){
+            fprintf(stderr, "Loader's stream has no readable shards\n");
+            exit(-1);
+        }
+        backoff(&spins);
+    }
+    return l->slots[head % LOADER_SLOTS];
+}
+
+void stop_loader(loader *l)
+{
+    int i;
+    atomic_store(&l->stop, 1);
+    if(l->started) pthread_join(l->thread, 0);
+    for(i = 0; i < LOADER_SLOTS; ++i){
+        free_data(l->slots[i]);
+    }
+    free_sampler(l->s);
+    free(l->ind);
+    free(l);
+}
@@ -1,16 +1,20 @@
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "uwnet.h"
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "parallel.h"
+#include "pool.h"
 
-void try_hw0()
-{
-    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
-    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
+// From test.c
+double what_time_is_it_now();
 
+net make_hw0_net()
+{
     net n = {0};
     n.n = 4;
     n.layers = calloc(n.n, sizeof(layer));
@@ -18,6 +22,15 @@ void try_hw0()
     n.layers[1] = make_activation_layer(RELU);
     n.layers[2] = make_connected_layer(32, 10);
     n.layers[3] = make_activation_layer(SOFTMAX);
+    return n;
+}
+
+void try_hw0()
+{
+    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
+    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
+
+    net n = make_hw0_net();
 
     int batch = 128;
     int iters = 1500;
@@ -26,6 +39,7 @@ void try_hw0()
     float decay = .0005;
 
     train_image_classifier(n, train, batch, iters, rate, momentum, decay);
+    print_pool_stats();
     printf("Training accuracy: %f\n", accuracy_net(n, train));
     printf("Testing  accuracy: %f\n", accuracy_net(n, test));
     free_data(train);
@@ -33,6 +47,161 @@ void try_hw0()
     free_net(n);
 }
 
+// Train the hw0 net synchronously and Hogwild! on the same number of
+// batches and compare how long they take and how well they do
+void compare_hogwild(int argc, char **argv)
+{
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+    if(threads > 0) set_num_threads(threads);
+    threads = parallel_threads();
+    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
+    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
+
+    int batch = 128;
+    int iters = 1500;
+    float rate = .01;
+    float momentum = .9;
+    float decay = .0005;
+
+    srand(0);
+    net sync = make_hw0_net();
+    double start = what_time_is_it_now();
+    train_image_classifier_parallel(sync, train, batch, iters, rate, momentum, decay, threads);
+    double sync_time = what_time_is_it_now() - start;
+
+    srand(0);
+    net hog = make_hw0_net();
+    start = what_time_is_it_now();
+    train_image_classifier_hogwild(hog, train, batch, iters, rate, momentum, decay, threads);
+    double hog_time = what_time_is_it_now() - start;
+
+    printf("%d threads, %d batches of %d\n", threads, iters, batch);
+    printf("Synchronous: %6.2f sec, training accuracy %f, testing accuracy %f\n",
+            sync_time, accuracy_net(sync, train), accuracy_net(sync, test));
+    printf("Hogwild:     %6.2f sec, training accuracy %f, testing accuracy %f\n",
+            hog_time, accuracy_net(hog, train), accuracy_net(hog, test));
+    free_net(sync);
+    free_net(hog);
+    free_data(train);
+    free_data(test);
+}
+
+// Train the hw0 net with several processes in a ring, each on its own
+// shard of the training set
+void try_ring(int argc, char **argv)
+{
+    int i;
+    int size = argc > 2 ? atoi(argv[2]) : 2;
+    if(size < 1) size = 1;
+    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
+    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
+
+    int batch = 128/size;
+    int iters = 1500;
+    float rate = .01;
+    float momentum = .9;
+    float decay = .0005;
+
+    // Split the cores between the processes
+    int threads = parallel_threads()/size;
+    set_num_threads(threads > 0 ? threads : 1);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/uwnet-ring-%d", (int)getpid());
+    int rank = 0;
+    for(i = 1; i < size; ++i){
+        pid_t pid = fork();
+        if(pid < 0){
+            fprintf(stderr, "Couldn't start ring process\n");
+            exit(-1);
+        }
+        if(pid == 0){
+            rank = i;
+            break;
+        }
+    }
+
+    ring *r = join_ring(path, rank, size);
+    net n = make_hw0_net();
+    double start = what_time_is_it_now();
+    train_image_classifier_ring(n, train, batch, iters, rate, momentum, decay, r);
+    double elapsed = what_time_is_it_now() - start;
+    leave_ring(r);
+    if(rank){
+        free_net(n);
+        free_data(train);
+        free_data(test);
+        exit(0);
+    }
+    for(i = 1; i < size; ++i) wait(0);
+    printf("%d processes, %d batches of %d each, %6.2f sec\n", size, iters, batch, elapsed);
+    printf("Training accuracy: %f\n", accuracy_net(n, train));
+    printf("Testing  accuracy: %f\n", accuracy_net(n, test));
+    free_net(n);
+    free_data(train);
+    free_data(test);
+}
+
+// Train the hw0 net on a parameter server with several worker processes
+void try_param_server(int argc, char **argv)
+{
+    int i;
+    int workers = argc > 2 ? atoi(argv[2]) : 2;
+    int staleness = argc > 3 ? atoi(argv[3]) : 4;
+    if(workers < 1) workers = 1;
+    data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
+    data test  = load_image_classification_data("mnist/mnist.test", "mnist/mnist.labels");
+
+    int batch = 128;
+    int updates = 1500;
+    float rate = .01;
+    float momentum = .9;
+    float decay = .0005;
+
+    // The server gets a core, the workers split the rest
+    int threads = (parallel_threads() - 1)/workers;
+    set_num_threads(threads > 0 ? threads : 1);
+    char name[64];
+    snprintf(name, sizeof(name), "/uwnet-ps-%d", (int)getpid());
+    net n = make_hw0_net();
+    param_server *s = serve_net(name, n, workers, staleness);
+    if(!s){
+        fprintf(stderr, "Couldn't make parameter server %s\n", name);
+        exit(-1);
+    }
+    for(i = 0; i < workers; ++i){
+        pid_t pid = fork();
+        if(pid < 0){
+            fprintf(stderr, "Couldn't start worker process\n");
+            exit(-1);
+        }
+        if(pid == 0){
+            param_server *c = connect_param_server(name);
+            net w = make_hw0_net();
+            if(c) train_image_classifier_worker(w, train, batch, c);
+            close_param_server(c);
+            free_net(w);
+            free_data(train);
+            free_data(test);
+            exit(0);
+        }
+    }
+
+    double start = what_time_is_it_now();
+    run_param_server(s, n, batch, updates, rate, momentum, decay);
+    double elapsed = what_time_is_it_now() - start;
+    for(i = 0; i < workers; ++i) wait(0);
+    long long applied, dropped, sparse;
+    param_server_stats(s, &applied, &dropped, &sparse);
+    close_param_server(s);
+    printf("%d workers, staleness %d, %6.2f sec\n", workers, staleness, elapsed);
+    printf("%lld gradients applied, %lld too stale, %lld sent sparse\n", applied, dropped, sparse);
+    printf("Training accuracy: %f\n", accuracy_net(n, train));
+    printf("Testing  accuracy: %f\n", accuracy_net(n, test));
+    free_net(n);
+    free_data(train);
+    free_data(test);
+}
+
 void try_hw1()
 {
     data train = load_image_classification_data("mnist/mnist.train", "mnist/mnist.labels");
@@ -57,6 +226,7 @@ void try_hw1()
     float decay = .0005;
 
     train_image_classifier(n, train, batch, iters, rate, momentum, decay);
+    print_pool_stats();
     printf("Training accuracy: %f\n", accuracy_net(n, train));
     printf("Testing  accuracy: %f\n", accuracy_net(n, test));
     free_data(train);
@@ -64,12 +234,71 @@ void try_hw1()
     free_net(n);
 }
 
+void pack(int argc, char **argv)
+{
+    if(argc < 4){
+        printf("usage: %s pack <image list> <label file> [packed file]\n", argv[0]);
+        return;
+    }
+    char buff[4096];
+    char *out = argc > 4 ? argv[4] : buff;
+    snprintf(buff, sizeof(buff), "%s.pack", argv[2]);
+    if(!pack_image_classification_data(argv[2], argv[3], out)){
+        fprintf(stderr, "Couldn't pack %s\n", argv[2]);
+        exit(-1);
+    }
+    printf("Packed %s into %s\n", argv[2], out);
+}
+
+void shard(int argc, char **argv)
+{
+    if(argc < 5){
+        printf("usage: %s shard <image list> <label file> <prefix> [examples per shard]\n", argv[0]);
+        return;
+    }
+    int per_shard = argc > 5 ? atoi(argv[5]) : 10000;
+    if(!pack_image_classification_shards(argv[2], argv[3], argv[4], per_shard)){
+        fprintf(stderr, "Couldn't shard %s\n", argv[2]);
+        exit(-1);
+    }
+    printf("Sharded %s into %s.shards\n", argv[2], argv[4]);
+}
+
+void share(int argc, char **argv)
+{
+    if(argc < 4){
+        printf("usage: %s %s <image list> <label file>\n", argv[0], argv[1]);
+        return;
+    }
+    if(0 == strcmp(argv[1], "unshare")){
+        if(!unshare_image_classification_data(argv[2], argv[3])){
+            fprintf(stderr, "%s isn't shared\n", argv[2]);
+        }
+        return;
+    }
+    data d = load_image_classification_shared(argv[2], argv[3]);
+    printf("Shared %d examples from %s\n", d.x.rows, argv[2]);
+    free_data(d);
+}
+
 int main(int argc, char **argv)
 {
     if(argc < 2){
-        printf("usage: %s [test | tryhw0 | tryhw1]\n", argv[0]);  
+        printf("usage: %s [test | tryhw0 | tryhw1 | hogwild | ring | ps | pack | shard | share | unshare]\n", argv[0]);  
+    } else if (0 == strcmp(argv[1], "pack")){
+        pack(argc, argv);
+    } else if (0 == strcmp(argv[1], "shard")){
+        shard(argc, argv);
+    } else if (0 == strcmp(argv[1], "share") || 0 == strcmp(argv[1], "unshare")){
+        share(argc, argv);
     } else if (0 == strcmp(argv[1], "tryhw0")){
         try_hw0();
+    } else if (0 == strcmp(argv[1], "hogwild")){
+        compare_hogwild(argc, argv);
+    } else if (0 == strcmp(argv[1], "ring")){
+        try_ring(argc, argv);
+    } else if (0 == strcmp(argv[1], "ps")){
+        try_param_server(argc, argv);
     } else if (0 == strcmp(argv[1], "tryhw1")){
         try_hw1();
     } else if (0 == strcmp(argv[1], "test")){
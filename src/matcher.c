@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include "matcher.h"
+
+// The automaton is a complete transition table over a compact alphabet:
+// only bytes that show up in some pattern get their own symbol, the rest
+// are symbol 0 and always lead back to the root. Matching is then one
+// table lookup per byte of text.
+
+static int add_node(matcher *m, int *capacity)
+{
+    int i;
+    if(m->nodes == *capacity){
+        *capacity *= 2;
+        m->next = realloc(m->next, (size_t)*capacity*m->symbols*sizeof(int));
+        m->pattern = realloc(m->pattern, *capacity*sizeof(int));
+    }
+    int u = m->nodes++;
+    for(i = 0; i < m->symbols; ++i) m->next[u*m->symbols + i] = -1;
+    m->pattern[u] = -1;
+    return u;
+}
+
+matcher *make_matcher(char **patterns, int n)
+{
+    int i, a;
+    matcher *m = calloc(1, sizeof(matcher));
+    m->n = n;
+    m->empty = -1;
+    m->symbols = 1;
+    for(i = 0; i < n; ++i){
+        unsigned char *p;
+        for(p = (unsigned char *)patterns[i]; *p; ++p){
+            if(!m->map[*p]) m->map[*p] = m->symbols++;
+        }
+    }
+
+    int capacity = 64;
+    m->next = calloc((size_t)capacity*m->symbols, sizeof(int));
+    m->pattern = calloc(capacity, sizeof(int));
+    m->same = calloc(n ? n : 1, sizeof(int));
+    add_node(m, &capacity);
+
+    // Build the trie
+    for(i = 0; i < n; ++i){
+        int u = 0;
+        unsigned char *p;
+        for(p = (unsigned char *)patterns[i]; *p; ++p){
+            int s = m->map[*p];
+            if(m->next[u*m->symbols + s] < 0){
+                int v = add_node(m, &capacity);
+                m->next[u*m->symbols + s] = v;
+            }
+            u = m->next[u*m->symbols + s];
+        }
+        m->same[i] = -1;
+        if(u == 0){
+            // The empty string is in every text
+            m->same[i] = m->empty;
+            m->empty = i;
+        } else if(m->pattern[u] < 0){
+            m->pattern[u] = i;
+        } else {
+            int j = m->pattern[u];
+            while(m->same[j] >= 0) j = m->same[j];
+            m->same[j] = i;
+        }
+    }
+
+    // Breadth first from the root, filling in failure transitions
+    int *fail = calloc(m->nodes, sizeof(int));
+    int *queue = calloc(m->nodes, sizeof(int));
+    m->dict = calloc(m->nodes, sizeof(int));
+    int head = 0, tail = 0;
+    for(a = 0; a < m->symbols; ++a){
+        int v = m->next[a];
+        if(v < 0 || a == 0){
+            m->next[a] = 0;
+        } else {
+            fail[v] = 0;
+            queue[tail++] = v;
+        }
+    }
+    while(head < tail){
+        int u = queue[head++];
+        m->dict[u] = (m->pattern[fail[u]] >= 0) ? fail[u] : m->dict[fail[u]];
+        for(a = 0; a < m->symbols; ++a){
+            int v = m->next[u*m->symbols + a];
+            if(v < 0 || a == 0){
+                m->next[u*m->symbols + a] = m->next[fail[u]*m->symbols + a];
+            } else {
+                fail[v] = m->next[fail[u]*m->symbols + a];
+                queue[tail++] = v;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return m;
+}
+
+void free_matcher(matcher *m)
+{
+    if(!m) return;
+    free(m->next);
+    free(m->pattern);
+    free(m->dict);
+    free(m->same);
+    free(m);
+}
+
+// Report pattern i and everything identical to it, once per text
+static int report(matcher *m, int i, unsigned *seen, unsigned stamp, void (*fn)(int i, void *ctx), void *ctx)
+{
+    int count = 0;
+    if(seen[i] == stamp) return 0;
+    for(; i >= 0; i = m->same[i]){
+        seen[i] = stamp;
+        fn(i, ctx);
+        ++count;
+    }
+    return count;
+}
+
+int match_patterns(matcher *m, char *text, void (*fn)(int i, void *ctx), void *ctx)
+{
+    // Stamps mark patterns already reported for this text so we never
+    // have to clear anything between calls
+    static __thread unsigned *seen = 0;
+    static __thread int seen_size = 0;
+    static __thread unsigned stamp = 0;
+    if(seen_size < m->n){
+        free(seen);
+        seen = calloc(m->n, sizeof(unsigned));
+        seen_size = m->n;
+        stamp = 0;
+    }
+    if(++stamp == 0){
+        memset(seen, 0, seen_size*sizeof(unsigned));
+        stamp = 1;
+    }
+
+    int count = 0;
+    if(m->empty >= 0) count += report(m, m->empty, seen, stamp, fn, ctx);
+    int u = 0;
+    unsigned char *p;
+    for(p = (unsigned char *)text; *p; ++p){
+        u = m->next[u*m->symbols + m->map[*p]];
+        int v = (m->pattern[u] >= 0) ? u : m->dict[u];
+        for(; v; v = m->dict[v]){
+            count += report(m, m->pattern[v], seen, stamp, fn, ctx);
+        }
+    }
+    return count;
+}
@@ -0,0 +1,39 @@
+// Include guards and C++ compatibility
+#ifndef MATCHER_H
+#define MATCHER_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Finds which of a set of strings occur anywhere in a piece of text in a
+// single pass over the text (Aho-Corasick), however many strings there
+// are. Gives the same answers as calling strstr with each of them.
+typedef struct matcher{
+    int n;              // number of patterns
+    int nodes;          // states in the automaton
+    int symbols;        // distinct bytes in the patterns, plus one for the rest
+    unsigned char map[256];
+    int *next;          // nodes x symbols transition table
+    int *pattern;       // first pattern ending at each node, -1 if none
+    int *dict;          // next node down the failure chain that ends a pattern
+    int *same;          // next pattern identical to this one, -1 if none
+    int empty;          // first empty pattern, these are in every text
+} matcher;
+
+// Build a matcher for a set of patterns
+// char **patterns: strings to look for
+// int n: number of patterns
+// returns: matcher, free with free_matcher
+matcher *make_matcher(char **patterns, int n);
+
+void free_matcher(matcher *m);
+
+// Call fn(i, ctx) once for every pattern i that occurs in text
+// Safe to call from several threads on the same matcher.
+// returns: number of distinct patterns found
+int match_patterns(matcher *m, char *text, void (*fn)(int i, void *ctx), void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,4 +1,6 @@
 #include "matrix.h"
+#include "pool.h"
+#include "parallel.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +8,20 @@
 #include <math.h>
 
 
+// Pick the row stride for a new matrix
+// Wide rows are padded to whole cache lines, and strides that are a
+// multiple of 1KB get one more cache line so walking down a column
+// doesn't keep landing in the same cache sets.
+// int rows, cols: size of matrix
+// returns: leading dimension in floats
+static int leading_dimension(int rows, int cols)
+{
+    if(rows <= 1 || cols < 64) return cols;
+    int ld = (cols + 15) & ~15;
+    if(ld % 256 == 0) ld += 16;
+    return ld;
+}
+
 // Make empty matrix filled with zeros
 // int rows: number of rows in matrix
 // int cols: number of columns in matrix
@@ -15,11 +31,48 @@ matrix make_matrix(int rows, int cols)
     matrix m;
     m.rows = rows;
     m.cols = cols;
+    m.ld = leading_dimension(rows, cols);
     m.shallow = 0;
-    m.data = calloc(m.rows*m.cols, sizeof(float));
+    m.data = pool_calloc((size_t)m.rows*m.ld, sizeof(float));
+    return m;
+}
+
+matrix float_to_matrix(float *data, int rows, int cols)
+{
+    matrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.ld = cols;
+    m.shallow = 1;
+    m.data = data;
     return m;
 }
 
+matrix view_rows(matrix m, int start, int n)
+{
+    assert(start >= 0 && n >= 0 && start + n <= m.rows);
+    matrix v = m;
+    v.rows = n;
+    v.data = m.data + (size_t)start*m.ld;
+    v.shallow = 1;
+    return v;
+}
+
+matrix view_cols(matrix m, int start, int n)
+{
+    assert(start >= 0 && n >= 0 && start + n <= m.cols);
+    matrix v = m;
+    v.cols = n;
+    v.data = m.data + start;
+    v.shallow = 1;
+    return v;
+}
+
+int is_contiguous(matrix m)
+{
+    return m.ld == m.cols || m.rows <= 1;
+}
+
 // Make a matrix with uniformly random elements
 // int rows, cols: size of matrix
 // float s: range of randomness, [-s, s]
@@ -30,7 +83,7 @@ matrix random_matrix(int rows, int cols, float s)
     int i, j;
     for(i = 0; i < rows; ++i){
         for(j = 0; j < cols; ++j){
-            m.data[i*cols + j] = 2*s*((float)rand()/RAND_MAX) - s;
+            m.data[i*m.ld + j] = 2*s*((float)rand()/RAND_MAX) - s;
         }
     }
     return m;
@@ -41,7 +94,7 @@ matrix random_matrix(int rows, int cols, float s)
 void free_matrix(matrix m)
 {
     if (!m.shallow && m.data) {
-        free(m.data);
+        pool_free(m.data);
     }
 }
 
@@ -53,8 +106,8 @@ matrix copy_matrix(matrix m)
     matrix c = make_matrix(m.rows, m.cols);
     // TODO: 1.1 - Fill in the new matrix
     int i;
-    for(i = 0; i < m.rows*m.cols; ++i){
-        c.data[i] = m.data[i];
+    for(i = 0; i < m.rows; ++i){
+        memcpy(c.data + i*c.ld, m.data + i*m.ld, m.cols*sizeof(float));
     }
     return c;
 }
@@ -68,10 +121,18 @@ matrix transpose_matrix(matrix m)
     // matrix t = make_matrix(1,1);
     matrix t = make_matrix(m.cols,m.rows);
 
-    int i, j;
-    for(i = 0; i < t.rows; ++i){
-        for(j = 0; j < t.cols; ++j){
-            t.data[i*t.cols + j] = m.data[j*m.cols + i];
+    // Go block by block so both the reads and writes stay in cache
+    int bs = 16;
+    int i, j, ii, jj;
+    for(ii = 0; ii < t.rows; ii += bs){
+        for(jj = 0; jj < t.cols; jj += bs){
+            int iend = (ii + bs < t.rows) ? ii + bs : t.rows;
+            int jend = (jj + bs < t.cols) ? jj + bs : t.cols;
+            for(i = ii; i < iend; ++i){
+                for(j = jj; j < jend; ++j){
+                    t.data[i*t.ld + j] = m.data[j*m.ld + i];
+                }
+            }
         }
     }
     return t;
@@ -86,13 +147,41 @@ void axpy_matrix(float a, matrix x, matrix y)
     assert(x.cols == y.cols);
     assert(x.rows == y.rows);
     // TODO: 1.3 - Perform the weighted sum, store result back in y
-    int i;
-    for(i = 0; i < x.rows*x.cols; ++i){
-        y.data[i] = a*x.data[i] + y.data[i];
+    int i, j;
+    for(i = 0; i < x.rows; ++i){
+        float *xi = x.data + i*x.ld;
+        float *yi = y.data + i*y.ld;
+        for(j = 0; j < x.cols; ++j){
+            yi[j] = a*xi[j] + yi[j];
+        }
+    }
+}
+
+// Products smaller than this many multiply-adds aren't worth splitting up
+#define MATMUL_PARALLEL_WORK (1<<18)
+
+typedef struct {
+    matrix a, b, c;
+} matmul_args;
+
+// Compute row i of c = a*b
+static void matmul_row(int i, void *ptr)
+{
+    matmul_args *p = ptr;
+    matrix a = p->a, b = p->b, c = p->c;
+    int j, k;
+    float *restrict ci = c.data + i*c.ld;
+    for(k = 0; k < a.cols; ++k){
+        float aik = a.data[i*a.ld + k];
+        const float *restrict bk = b.data + k*b.ld;
+        for(j = 0; j < c.cols; ++j){
+            ci[j] += aik*bk[j];
+        }
     }
 }
 
 // Perform matrix multiplication a*b, return result
+// Big products are split across threads by rows of the result.
 // matrix a,b: operands
 // returns: new matrix that is the result
 matrix matmul(matrix a, matrix b)
@@ -100,16 +189,14 @@ matrix matmul(matrix a, matrix b)
     assert(a.cols == b.rows);
     matrix c = make_matrix(a.rows, b.cols);
     // TODO: 1.4 - Implement matrix multiplication. Make sure it's fast!
-    int i, j, k;
-    for(i = 0; i < c.rows; ++i){
-        for(k = 0; k < a.cols; ++k){
-            for(j = 0; j < c.cols; ++j){
-                c.data[i*c.cols + j] += a.data[i*a.cols + k]*b.data[k*b.cols + j];
-            }
-        }
+    int i;
+    matmul_args args = {a, b, c};
+    if((long long)a.rows*a.cols*b.cols >= MATMUL_PARALLEL_WORK){
+        parallel_for(c.rows, matmul_row, &args);
+    } else {
+        for(i = 0; i < c.rows; ++i) matmul_row(i, &args);
     }
 
-
     return c;
 }
 
@@ -121,7 +208,7 @@ void scal_matrix(float s, matrix m)
     int i, j;
     for(i = 0; i < m.rows; ++i){
         for(j =0 ; j < m.cols; ++j){
-            m.data[i*m.cols + j] *= s;
+            m.data[i*m.ld + j] *= s;
         }
     }
 }
@@ -141,7 +228,7 @@ void print_matrix(matrix m)
     for(i = 0; i < m.rows; ++i){
         printf("|  ");
         for(j = 0; j < m.cols; ++j){
-            printf("%15.7f ", m.data[i*m.cols + j]);
+            printf("%15.7f ", m.data[i*m.ld + j]);
         }
         printf(" |\n");
     }
@@ -157,11 +244,11 @@ matrix augment_matrix(matrix m)
     matrix c = make_matrix(m.rows, m.cols*2);
     for(i = 0; i < m.rows; ++i){
         for(j = 0; j < m.cols; ++j){
-            c.data[i*c.cols + j] = m.data[i*m.cols + j];
+            c.data[i*c.ld + j] = m.data[i*m.ld + j];
         }
     }
     for(j = 0; j < m.rows; ++j){
-        c.data[j*c.cols + j+m.cols] = 1;
+        c.data[j*c.ld + j+m.cols] = 1;
     }
     return c;
 }
@@ -180,7 +267,7 @@ matrix matrix_invert(matrix m)
     //print_matrix(c);
     float **cdata = calloc(c.rows, sizeof(float *));
     for(i = 0; i < c.rows; ++i){
-        cdata[i] = c.data + i*c.cols;
+        cdata[i] = c.data + i*c.ld;
     }
 
 
@@ -230,7 +317,7 @@ matrix matrix_invert(matrix m)
     matrix inv = make_matrix(m.rows, m.cols);
     for(i = 0; i < m.rows; ++i){
         for(j = 0; j < m.cols; ++j){
-            inv.data[i*m.cols + j] = cdata[i][j+m.cols];
+            inv.data[i*inv.ld + j] = cdata[i][j+m.cols];
         }
     }
     free_matrix(c);
@@ -254,12 +341,26 @@ matrix solve_system(matrix M, matrix b)
 
 void write_matrix(matrix m, FILE *fp)
 {
-    fwrite(m.data, sizeof(float), m.rows*m.cols, fp);
+    if(is_contiguous(m)){
+        fwrite(m.data, sizeof(float), m.rows*m.cols, fp);
+        return;
+    }
+    int i;
+    for(i = 0; i < m.rows; ++i){
+        fwrite(m.data + i*m.ld, sizeof(float), m.cols, fp);
+    }
 }
 
 void read_matrix(matrix m, FILE *fp)
 {
-     assert(fread(m.data, sizeof(float), m.rows*m.cols, fp) == m.rows*m.cols);
+    if(is_contiguous(m)){
+        assert(fread(m.data, sizeof(float), m.rows*m.cols, fp) == m.rows*m.cols);
+        return;
+    }
+    int i;
+    for(i = 0; i < m.rows; ++i){
+        assert(fread(m.data + i*m.ld, sizeof(float), m.cols, fp) == m.cols);
+    }
 }
 
 void save_matrix(matrix m, char *fname)
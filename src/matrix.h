@@ -10,8 +10,12 @@ extern "C" {
 // and some data stored as an array of floats
 // storage is row-major order:
 // https://en.wikipedia.org/wiki/Row-_and_column-major_order
+// Rows start ld floats apart (ld >= cols), so element (i, j) is at
+// data[i*ld + j]. Padding rows keeps them aligned and lets a matrix be a
+// view into part of a bigger one.
 typedef struct matrix{
     int rows, cols;
+    int ld;
     float *data;
     int shallow;
 } matrix;
@@ -29,6 +33,22 @@ matrix make_matrix(int rows, int cols);
 // returns: matrix of rows x cols with elements in range [-s,s]
 matrix random_matrix(int rows, int cols, float s);
 
+// Wrap existing contiguous data in a matrix, doesn't copy or take ownership
+// float *data: rows*cols floats in row-major order
+// returns: shallow matrix with ld == cols
+matrix float_to_matrix(float *data, int rows, int cols);
+
+// Make a matrix that shares rows [start, start+n) of m
+// returns: shallow view into m, valid as long as m is
+matrix view_rows(matrix m, int start, int n);
+
+// Make a matrix that shares columns [start, start+n) of m
+// returns: shallow view into m, valid as long as m is
+matrix view_cols(matrix m, int start, int n);
+
+// Check if rows of a matrix are packed with no gaps
+int is_contiguous(matrix m);
+
 // Free memory associated with matrix
 // matrix m: matrix to be freed
 void free_matrix(matrix m);
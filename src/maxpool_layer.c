@@ -3,6 +3,95 @@
 #include <assert.h>
 #include <float.h>
 #include "uwnet.h"
+#include "parallel.h"
+
+typedef struct {
+    layer l;
+    matrix src, dst;        // in and out going forward, dy and dx going back
+    int outw, outh;
+    int paddingSize;
+} pool_args;
+
+// Pool one channel of one example, t is example*channels + channel
+static void pool_plane(int t, void *ptr)
+{
+    pool_args *a = ptr;
+    layer l = a->l;
+    matrix in = a->src, out = a->dst;
+    int r = t / l.channels;
+    int channel = t % l.channels;
+    int row, col, kernelRow, kernelCol;
+    int paddingSize = a->paddingSize;
+    int index = channel*a->outw*a->outh;
+    for (row = 0; row < l.height; row += l.stride) {
+        for (col = 0; col < l.width; col += l.stride) {
+            float maxPixel = -1000000000.0;
+            for (kernelRow = -paddingSize; kernelRow <= l.size - 1 - paddingSize; kernelRow++) { //for every row in kernel
+                for (kernelCol = -paddingSize; kernelCol <= l.size - 1 - paddingSize; kernelCol++) { //for every col in kernel
+                    int curRow = row + kernelRow;
+                    int curCol = col + kernelCol;
+
+                    float pixelVal;
+                    if(curRow >= 0 && curRow < l.height && curCol >= 0 && curCol < l.width) {
+                        int inx = (l.width*curRow) + (l.width*l.height*channel) + curCol + r * in.ld;
+                        pixelVal = in.data[inx];
+                    } else {
+                        pixelVal = -1000000000.0;
+                    }
+
+                    if (pixelVal > maxPixel) {
+                        maxPixel = pixelVal;
+                    }
+                }
+            }
+
+            out.data[r*out.ld + index] = maxPixel;
+            index++;
+        }
+    }
+}
+
+// Send one channel of one example's dL/dy back to its maxes
+// Overlapping windows only ever add into their own example and channel.
+static void unpool_plane(int t, void *ptr)
+{
+    pool_args *a = ptr;
+    layer l = a->l;
+    matrix dy = a->src, dx = a->dst;
+    int r = t / l.channels;
+    int channel = t % l.channels;
+    int row, col, kernelRow, kernelCol;
+    int paddingSize = a->paddingSize;
+    const float *x = l.x->data + r*l.x->ld;
+    for(row = 0; row < a->outh; row++) {
+        for(col = 0; col < a->outw; col++) {
+            int colInx =  (channel * a->outh + row) * a->outw + col;
+            float maxPixel = -1000000000.0;
+            int maxInx = 0;
+            for(kernelRow = 0; kernelRow < l.size; kernelRow++){ //for every row in kernel
+                for(kernelCol = 0; kernelCol < l.size; kernelCol++){ //for every column in kernel
+                    int curRow = (row*l.stride + kernelRow) - paddingSize;
+                    int curCol = (col*l.stride + kernelCol) - paddingSize;
+
+                    float pixelVal;
+                    int inx = (l.width*curRow) + (l.width*l.height*channel) + curCol;
+                    if (curRow >= 0 && curRow < l.height && curCol >= 0 && curCol < l.width) {
+                        pixelVal = x[inx];
+                    } else {
+                        pixelVal = -1000000000.0;
+                    }
+
+                    if(pixelVal > maxPixel) {
+                        maxPixel = pixelVal;
+                        maxInx = inx;
+                    }
+                }
+            }
+
+            dx.data[r*dx.ld + maxInx] += dy.data[r*dy.ld + colInx];
+        }
+    }
+}
 
 // Run a maxpool layer on input
 // layer l: pointer to layer to run
@@ -12,7 +101,7 @@ matrix forward_maxpool_layer(layer l, matrix in)
 {
     // Saving our input
     // Probably don't change this
-    int channel, row, col, kernelRow, kernelCol, paddingSize, index, r;
+    int paddingSize;
     free_matrix(*l.x);
     *l.x = copy_matrix(in);
 
@@ -29,37 +118,9 @@ matrix forward_maxpool_layer(layer l, matrix in)
     }
 
 
-    for(r = 0; r < in.rows; r++) {
-        index = 0;
-        for (channel = 0; channel < l.channels; channel++) {
-            for (row = 0; row < l.height; row += l.stride) {
-                for (col = 0; col < l.width; col += l.stride) {
-                    float maxPixel = -1000000000.0;
-                    for (kernelRow = -paddingSize; kernelRow <= l.size - 1 - paddingSize; kernelRow++) { //for every row in kernel
-                        for (kernelCol = -paddingSize; kernelCol <= l.size - 1 - paddingSize; kernelCol++) { //for every col in kernel
-                           int curRow = row + kernelRow;
-                            int curCol = col + kernelCol;
-                            
-                            float pixelVal;
-                            if(curRow >= 0 && curRow < l.height && curCol >= 0 && curCol < l.width) {
-                                int inx = (l.width*curRow) + (l.width*l.height*channel) + curCol + r * in.cols;
-                                pixelVal = in.data[inx];
-                            } else {
-                                pixelVal = -1000000000.0;
-                            }
-
-                            if (pixelVal > maxPixel) {
-                                maxPixel = pixelVal;
-                            }
-                        }
-                    }
-
-                    out.data[r*out.cols + index] = maxPixel;
-                    index++;
-                }
-            }
-        }
-    }
+    // Every example and channel is pooled on its own
+    pool_args a = {l, in, out, outw, outh, paddingSize};
+    parallel_for(in.rows*l.channels, pool_plane, &a);
     return out;
 }
 
@@ -68,60 +129,23 @@ matrix forward_maxpool_layer(layer l, matrix in)
 // matrix dy: error term for the previous layer
 matrix backward_maxpool_layer(layer l, matrix dy)
 {
-    matrix in    = *l.x;
     matrix dx = make_matrix(dy.rows, l.width*l.height*l.channels);
 
     int outw = (l.width-1)/l.stride + 1;
     int outh = (l.height-1)/l.stride + 1;
 
-    matrix out = make_matrix(in.rows, outw*outh*l.channels);
-
     // TODO: 6.2 - find the max values in the input again and fill in the
     // corresponding delta with the delta from the output. This should be
     // similar to the forward method in structure.
-    int channel, row, col, kernelRow, kernelCol, paddingSize;
+    int paddingSize;
     if(l.size % 2 == 0) { //Even
         paddingSize = 0;
     } else { //Odd
         paddingSize = l.size/2;
     }
 
-    for (channel = 0; channel < l.channels; channel++) {
-        for(row = 0; row < outh; row++) {
-            for(col = 0; col < outw; col++) {
-                int colInx =  (channel * outh + row) * outw + col;
-                float maxPixel = -1000000000.0;
-                int maxInx = 0;
-                for(kernelRow = 0; kernelRow < l.size; kernelRow++){ //for every row in kernel
-                    for(kernelCol = 0; kernelCol < l.size; kernelCol++){ //for every column in kernel
-                        int curRow = (row*l.stride + kernelRow) - paddingSize;
-                        int curCol = (col*l.stride + kernelCol) - paddingSize;
-
-                        float pixelVal;
-                        int inx = (l.width*curRow) + (l.width*l.height*channel) + curCol;
-                        if (curRow >= 0 && curRow < l.height && curCol >= 0 && curCol < l.width) {
-                            pixelVal = in.data[inx];
-                        } else {
-                            pixelVal = -1000000000.0;
-                        }
-
-                        if(pixelVal > maxPixel) {
-                            maxPixel = pixelVal;
-                            maxInx = inx;
-                        }
-                    }
-                }
-
-                out.data[colInx] = maxInx;
-            }
-        }
-    }
-
-    int dy_i;
-    for(dy_i = 0; dy_i < outh*outw*l.channels; dy_i++){
-        int dx_i = out.data[dy_i];
-        dx.data[dx_i] += dy.data[dy_i];
-    }
+    pool_args a = {l, dy, dx, outw, outh, paddingSize};
+    parallel_for(dy.rows*l.channels, unpool_plane, &a);
 
     return dx;
 }
@@ -16,13 +16,17 @@ matrix forward_net(net m, matrix input)
     return x;
 }
 
-void backward_net(net m, matrix d)
+// Run a net backward, calling done(i, ctx) as soon as layer i has added
+// its gradients in, so they can be sent off while earlier layers run
+// void (*done)(int i, void *ctx): called after each layer, or 0
+void backward_net_hook(net m, matrix d, void (*done)(int i, void *ctx), void *ctx)
 {
     matrix dy = copy_matrix(d);
     int i;
     for (i = m.n-1; i >= 0; --i) {
         layer l = m.layers[i];
         matrix dx = l.backward(l, dy);
+        if(done) done(i, ctx);
 
         free_matrix(dy);
         dy = dx;
@@ -30,6 +34,11 @@ void backward_net(net m, matrix d)
     free_matrix(dy);
 }
 
+void backward_net(net m, matrix d)
+{
+    backward_net_hook(m, d, 0, 0);
+}
+
 void update_net(net m, float rate, float momentum, float decay)
 {
     int i;
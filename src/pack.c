@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include "uwnet.h"
+#include "pool.h"
+#include "parallel.h"
+#include "matcher.h"
+#include "pack.h"
+#include "fileio.h"
+
+// From data.c
+int find_labels(matcher *labels, char *path, int *first);
+
+static int file_stamp(char *filename, long long *size, long long *mtime)
+{
+    struct stat st;
+    if(stat(filename, &st)) return 0;
+    *size = st.st_size;
+    *mtime = (long long)st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+    return 1;
+}
+
+typedef struct {
+    char **paths;
+    matcher *labels;
+    image shape;
+    unsigned char *pixels;
+    int *ids;
+    matrix y;
+    atomic_int failed;
+} pack_args;
+
+static void set_label(int j, void *row)
+{
+    ((float *)row)[j] = 1;
+}
+
+static void pack_example(int i, unsigned char *buf, size_t size, void *ptr)
+{
+    pack_args *a = ptr;
+    image s = a->shape;
+    int cols = s.w*s.h*s.c;
+    if(!buf) fprintf(stderr, "Couldn't read file %s\n", a->paths[i]);
+    if(!buf || !load_image_memory_into_bytes(buf, size, a->paths[i],
+                a->pixels + (size_t)i*cols, s.w, s.h, s.c)){
+        atomic_store(&a->failed, 1);
+        return;
+    }
+    if(a->ids){
+        // One int per example can't represent a path matching several labels
+        if(find_labels(a->labels, a->paths[i], &a->ids[i]) > 1){
+            fprintf(stderr, "%s matches more than one label\n", a->paths[i]);
+            atomic_store(&a->failed, 1);
+        }
+    } else {
+        match_patterns(a->labels, a->paths[i], set_label, a->y.data + (size_t)i*a->y.ld);
+    }
+}
+
+// Decode every image in a list to 8-bit pixels in parallel
+// image shape: size of every image
+// unsigned char *pixels: room for n rows of w*h*c bytes
+// int *ids: filled with one label per example, or 0 to fill in y instead
+// matrix y: dense labels to fill in when ids is 0
+// returns: 1 on success, 0 if any image failed
+static int decode_bytes(char **paths, int n, char **labels, int k, image shape,
+        unsigned char *pixels, int *ids, matrix y)
+{
+    pack_args a = {paths, make_matcher(labels, k), shape, pixels, ids, y};
+    atomic_init(&a.failed, 0);
+    process_files(paths, n, pack_example, &a);
+    free_matcher(a.labels);
+    return !atomic_load(&a.failed);
+}
+
+// Fill in the shape and offsets of a packed data set from its first image
+static void pack_layout(char **paths, int n, int k, pack_header *h)
+{
+    memcpy(h->magic, PACK_MAGIC, sizeof(h->magic));
+    image im = load_image(paths[0]);
+    h->n = n;
+    h->w = im.w;
+    h->h = im.h;
+    h->c = im.c;
+    h->k = k;
+    free_image(im);
+    size_t cols = (size_t)h->w*h->h*h->c;
+    h->pixels = PACK_ALIGN;
+    h->labels = h->pixels + ((n*cols + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1));
+    h->size = h->labels + n*sizeof(int);
+}
+
+// Decode some images into one packed file
+// pack_header h: header with the list file stamps filled in
+// returns: 1 on success, 0 if the file couldn't be written
+static int write_pack(char **paths, int n, char **labels, int k, pack_header h, char *filename)
+{
+    int ok = 0;
+    int fd = -1;
+    char *map = MAP_FAILED;
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    pack_layout(paths, n, k, &h);
+    image im = {h.w, h.h, h.c, 0};
+
+    // Workers write straight into the mapped file
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, h.size)) goto done;
+    map = mmap(0, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) goto done;
+
+    matrix none = {0};
+    if(!decode_bytes(paths, n, labels, k, im, (unsigned char *)map + h.pixels, (int *)(map + h.labels), none)) goto done;
+    memcpy(map, &h, sizeof(h));
+    if(msync(map, h.size, MS_SYNC)) goto done;
+    ok = !rename(tmp, filename);
+
+done:
+    if(map != MAP_FAILED) munmap(map, h.size);
+    if(fd >= 0) close(fd);
+    if(!ok) unlink(tmp);
+    return ok;
+}
+
+// Decode an image list into a packed data file
+// char *images: file with one image path per line
+// char *label_file: file with one label per line
+// char *filename: packed file to write
+// returns: 1 on success, 0 if the data couldn't be packed
+int pack_image_classification_data(char *images, char *label_file, char *filename)
+{
+    lines image_list = read_lines(images);
+    lines label_list = read_lines(label_file);
+    int ok = 0;
+    pack_header h = {{0}};
+    if(image_list.n && file_stamp(images, &h.images_size, &h.images_mtime)
+            && file_stamp(label_file, &h.labels_size, &h.labels_mtime)){
+        ok = write_pack(image_list.line, image_list.n, label_list.line, label_list.n, h, filename);
+    }
+    free_lines(image_list);
+    free_lines(label_list);
+    return ok;
+}
+
+// Decode an image list into a set of packed shards for streaming
+// Writes <prefix>.00000.pack, <prefix>.00001.pack, ... and <prefix>.shards
+// listing them, one per line. Only one shard is decoded at a time.
+// int per_shard: examples in each shard
+// returns: 1 on success, 0 if the data couldn't be packed
+int pack_image_classification_shards(char *images, char *label_file, char *prefix, int per_shard)
+{
+    lines image_list = read_lines(images);
+    lines label_list = read_lines(label_file);
+    int n = image_list.n;
+    int ok = n > 0 && per_shard > 0;
+    int i;
+    char name[4096];
+    snprintf(name, sizeof(name), "%s.shards", prefix);
+    FILE *fp = ok ? fopen(name, "w") : 0;
+    if(!fp) ok = 0;
+    pack_header h = {{0}};
+    if(ok) ok = file_stamp(images, &h.images_size, &h.images_mtime)
+            && file_stamp(label_file, &h.labels_size, &h.labels_mtime);
+    for(i = 0; ok && i*(size_t)per_shard < n; ++i){
+        int start = i*per_shard;
+        int count = (n - start < per_shard) ? n - start : per_shard;
+        snprintf(name, sizeof(name), "%s.%05d.pack", prefix, i);
+        ok = write_pack(image_list.line + start, count, label_list.line, label_list.n, h, name);
+        if(ok) fprintf(fp, "%s\n", name);
+    }
+    if(fp && fclose(fp)) ok = 0;
+    free_lines(image_list);
+    free_lines(label_list);
+    return ok;
+}
+
+// Check a packed header is whole and was built from these list files
+// size_t size: size of the file or segment it came from
+// char *images, *label_file: list files it should match, or 0 to skip the check
+static int pack_is_current(pack_header *h, size_t size, char *images, char *label_file)
+{
+    long long file_size, mtime;
+    int valid = !memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) && h->size == size;
+    if(valid && images){
+        valid = file_stamp(images, &file_size, &mtime) && file_size == h->images_size && mtime == h->images_mtime;
+    }
+    if(valid && label_file){
+        valid = file_stamp(label_file, &file_size, &mtime) && file_size == h->labels_size && mtime == h->labels_mtime;
+    }
+    return valid;
+}
+
+// Map a packed data file and check it was built from these list files
+// returns: pointer to the mapped file, 0 if it is missing or stale
+static char *map_pack(char *filename, char *images, char *label_file, pack_header *h)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat st;
+    char *map = 0;
+    if(fstat(fd, &st) || st.st_size < (off_t)sizeof(pack_header)) goto done;
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED){
+        map = 0;
+        goto done;
+    }
+    memcpy(h, map, sizeof(*h));
+    if(!pack_is_current(h, st.st_size, images, label_file)){
+        fprintf(stderr, "Packed data %s is out of date, ignoring it\n", filename);
+        munmap(map, st.st_size);
+        map = 0;
+    }
+done:
+    close(fd);
+    return map;
+}
+
+typedef struct {
+    unsigned char *pixels;
+    int *labels;
+    float lut[256];
+    data d;
+} unpack_args;
+
+static void unpack_example(int i, void *ptr)
+{
+    unpack_args *a = ptr;
+    int j;
+    matrix x = a->d.x;
+    unsigned char *p = a->pixels + (size_t)i*x.cols;
+    float *row = x.data + (size_t)i*x.ld;
+    for(j = 0; j < x.cols; ++j){
+        row[j] = a->lut[p[j]];
+    }
+    if(a->labels[i] >= 0) a->d.y.data[(size_t)i*a->d.y.ld + a->labels[i]] = 1;
+}
+
+// Load a packed data file if it is up to date with the list files
+// char *filename: packed file
+// char *images, *label_file: list files it should match, or 0 to skip the check
+// data *d: filled in with the data set
+// returns: 1 if the data was loaded, 0 otherwise
+int load_packed_data(char *filename, char *images, char *label_file, data *d)
+{
+    pack_header h;
+    char *map = map_pack(filename, images, label_file, &h);
+    if(!map) return 0;
+    int i;
+    unpack_args a;
+    a.pixels = (unsigned char *)map + h.pixels;
+    a.labels = (int *)(map + h.labels);
+    for(i = 0; i < 256; ++i) a.lut[i] = (float)i/255.;
+    a.d = make_data(h.n, h.w*h.h*h.c, h.k);
+    parallel_for(h.n, unpack_example, &a);
+    munmap(map, h.size);
+    *d = a.d;
+    return 1;
+}
+
+// Load an image classification data set keeping pixels as bytes and
+// labels as class ids
+// Uses <images>.pack directly out of the page cache when it is up to date,
+// otherwise decodes every image. Falls back to dense labels if a path
+// matches more than one label.
+// char *images: file with one image path per line
+// char *label_file: file with one label per line
+// returns: data set in 8-bit mode
+data load_image_classification_bytes(char *images, char *label_file)
+{
+    data d = {0};
+    pack_header h;
+    char pack[4096];
+    snprintf(pack, sizeof(pack), "%s.pack", images);
+    char *map = map_pack(pack, images, label_file, &h);
+    if(map){
+        d.x = float_to_matrix(0, h.n, h.w*h.h*h.c);
+        d.y = float_to_matrix(0, h.n, h.k);
+        d.bytes = (unsigned char *)map + h.pixels;
+        d.labels = (int *)(map + h.labels);
+        d.map = map;
+        d.map_size = h.size;
+        return d;
+    }
+
+    lines image_list = read_lines(images);
+    lines label_list = read_lines(label_file);
+    int n = image_list.n;
+    int k = label_list.n;
+    char **paths = image_list.line;
+    char **labels = label_list.line;
+    if(n){
+        image im = load_image(paths[0]);
+        free_image(im);
+        im.data = 0;
+        int cols = im.w*im.h*im.c;
+        d.x = float_to_matrix(0, n, cols);
+        d.y = float_to_matrix(0, n, k);
+        d.bytes = pool_calloc((size_t)n*cols, 1);
+        d.labels = pool_calloc(n, sizeof(int));
+        matrix none = {0};
+        if(!decode_bytes(paths, n, labels, k, im, d.bytes, d.labels, none)){
+            // Some path matched several labels, only dense rows can say that
+            pool_free(d.labels);
+            d.labels = 0;
+            d.y = make_matrix(n, k);
+            if(!decode_bytes(paths, n, labels, k, im, d.bytes, 0, d.y)){
+                fprintf(stderr, "Couldn't load image data from %s\n", images);
+                exit(0);
+            }
+        }
+    }
+    free_lines(image_list);
+    free_lines(label_list);
+    return d;
+}
+
+// Name of the shared memory segment for a list and label file
+// Processes that name the same files by different relative paths still
+// find the same segment.
+static void shared_name(char *images, char *label_file, char *name, size_t size)
+{
+    int i;
+    char path[PATH_MAX];
+    char *files[2] = {images, label_file};
+    unsigned long long hash = 1469598103934665603ULL;
+    for(i = 0; i < 2; ++i){
+        char *p = realpath(files[i], path) ? path : files[i];
+        for(; *p; ++p){
+            hash ^= (unsigned char)*p;
+            hash *= 1099511628211ULL;
+        }
+        hash ^= 0xff;
+        hash *= 1099511628211ULL;
+    }
+    snprintf(name, size, "/uwnet-%016llx", hash);
+}
+
+// Unlink a stale segment, unless the name has moved on to a fresh one
+// Everyone unlinks a stale segment under its exclusive lock, and checks the
+// name still refers to it first, so a segment someone just published in its
+// place is never the one removed.
+// int fd: open descriptor of the stale segment
+static void unlink_stale(char *name, int fd, struct stat *st)
+{
+    struct stat now;
+    flock(fd, LOCK_EX);
+    int fresh = shm_open(name, O_RDONLY, 0);
+    if(fresh >= 0 && !fstat(fresh, &now) && now.st_dev == st->st_dev && now.st_ino == st->st_ino){
+        shm_unlink(name);
+    }
+    if(fresh >= 0) close(fresh);
+    flock(fd, LOCK_UN);
+}
+
+// Attach a published data set read-only
+// Waits for the process publishing it to finish. Stale or half written
+// segments are unlinked so the caller can publish a fresh one.
+// returns: 1 if attached, 0 if there is nothing usable to attach to
+static int attach_shared(char *name, char *images, char *label_file, data *d)
+{
+    int tries;
+    for(tries = 0; tries < 1000; ++tries){
+        int fd = shm_open(name, O_RDONLY, 0);
+        if(fd < 0) return 0;
+        struct stat st;
+        pack_header h;
+        char *map = MAP_FAILED;
+        // The publisher holds an exclusive lock until the data is whole
+        flock(fd, LOCK_SH);
+        if(fstat(fd, &st) || st.st_size < (off_t)sizeof(pack_header)){
+            // Created but not locked yet, give the publisher a moment
+            close(fd);
+            struct timespec ts = {0, 1000000};
+            nanosleep(&ts, 0);
+            continue;
+        }
+        map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(map == MAP_FAILED){
+            close(fd);
+            return 0;
+        }
+        memcpy(&h, map, sizeof(h));
+        if(!pack_is_current(&h, st.st_size, images, label_file)){
+            munmap(map, st.st_size);
+            unlink_stale(name, fd, &st);
+            close(fd);
+            return 0;
+        }
+        close(fd);
+        d->x = float_to_matrix(0, h.n, h.w*h.h*h.c);
+        d->y = float_to_matrix(0, h.n, h.k);
+        d->bytes = (unsigned char *)map + h.pixels;
+        d->labels = (int *)(map + h.labels);
+        d->map = map;
+        d->map_size = h.size;
+        return 1;
+    }
+    return 0;
+}
+
+// Decode a data set into a new shared memory segment
+// returns: 1 if published and d attached, 0 if it can't be shared,
+//          -1 if another process created the segment first
+static int publish_shared(char *name, char *images, char *label_file, data *d)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0) return errno == EEXIST ? -1 : 0;
+    flock(fd, LOCK_EX);
+    lines image_list = read_lines(images);
+    lines label_list = read_lines(label_file);
+    char *map = MAP_FAILED;
+    int ok = 0;
+    pack_header h = {{0}};
+    if(!image_list.n || !file_stamp(images, &h.images_size, &h.images_mtime)
+            || !file_stamp(label_file, &h.labels_size, &h.labels_mtime)) goto done;
+    pack_layout(image_list.line, image_list.n, label_list.n, &h);
+    // Reserve the pages now, running out of shared memory later is SIGBUS
+    if(posix_fallocate(fd, 0, h.size)) goto done;
+    map = mmap(0, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) goto done;
+    image im = {h.w, h.h, h.c, 0};
+    matrix none = {0};
+    if(!decode_bytes(image_list.line, h.n, label_list.line, h.k, im,
+                (unsigned char *)map + h.pixels, (int *)(map + h.labels), none)) goto done;
+    memcpy(map, &h, sizeof(h));
+    mprotect(map, h.size, PROT_READ);
+    d->x = float_to_matrix(0, h.n, h.w*h.h*h.c);
+    d->y = float_to_matrix(0, h.n, h.k);
+    d->bytes = (unsigned char *)map + h.pixels;
+    d->labels = (int *)(map + h.labels);
+    d->map = map;
+    d->map_size = h.size;
+    ok = 1;
+
+done:
+    if(!ok){
+        if(map != MAP_FAILED) munmap(map, h.size);
+        shm_unlink(name);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    free_lines(image_list);
+    free_lines(label_list);
+    return ok;
+}
+
+// Load an image classification data set from POSIX shared memory
+// The first process to ask decodes the images into a named segment laid
+// out like a packed file, later ones map it read-only, so every process
+// on the host shares one copy. The segment outlives the processes, remove
+// it with unshare_image_classification_data. Falls back to
+// load_image_classification_bytes when a path matches several labels.
+// char *images: file with one image path per line
+// char *label_file: file with one label per line
+// returns: data set in 8-bit mode
+data load_image_classification_shared(char *images, char *label_file)
+{
+    int tries;
+    data d = {0};
+    char name[64];
+    shared_name(images, label_file, name, sizeof(name));
+    for(tries = 0; tries < 3; ++tries){
+        if(attach_shared(name, images, label_file, &d)) return d;
+        int r = publish_shared(name, images, label_file, &d);
+        if(r > 0) return d;
+        if(r == 0) break;
+    }
+    return load_image_classification_bytes(images, label_file);
+}
+
+// Remove the shared memory segment for a data set
+// Processes already attached keep their mapping.
+// returns: 1 if there was one to remove
+int unshare_image_classification_data(char *images, char *label_file)
+{
+    char name[64];
+    shared_name(images, label_file, name, sizeof(name));
+    return !shm_unlink(name);
+}
@@ -0,0 +1,28 @@
+// Include guards and C++ compatibility
+#ifndef PACK_H
+#define PACK_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A packed data set is one file: a header, then every example's pixels as
+// uint8 in the same planar order as a row of x, then one int label per
+// example. The header records the size and modification time of the list
+// and label files it was built from so we can tell when it is stale.
+
+#define PACK_MAGIC "UWNPACK1"
+#define PACK_ALIGN 4096
+
+typedef struct {
+    char magic[8];
+    int n, w, h, c, k;
+    long long images_size, images_mtime;
+    long long labels_size, labels_mtime;
+    long long pixels, labels;
+    long long size;
+} pack_header;
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "parallel.h"
+#include "pool.h"
+
+// Chunks each participant starts with, more balances better but costs
+// more trips to the deques
+#define CHUNKS_PER_THREAD 8
+
+// One pool of worker threads runs every parallel loop in the library.
+// A loop's iterations are cut into chunks and dealt out to the
+// participants' deques in contiguous runs. Each participant works from
+// the back of its own deque and, when that is empty, steals the front
+// half of someone else's. Loops started from different threads at once
+// are all on the list of active jobs, and an idle worker joins whichever
+// has the fewest participants, so they share the pool. A loop started
+// from inside one runs on the calling thread, whose core is already
+// counted.
+
+// A deque of chunks is just a range [top, bottom) of chunk ids, since
+// chunks are dealt and stolen in contiguous runs
+typedef struct {
+    atomic_flag lock;
+    int top, bottom;
+    char pad[52];
+} deque;
+
+typedef struct job {
+    int n;
+    int chunks;
+    int participants;
+    void (*body)(int i, int worker, void *ctx);
+    void *ctx;
+    deque *deques;
+    // Participants so far, the caller is participant 0
+    int joined;
+    // Participants still working, the caller waits for this to reach 0
+    atomic_int active;
+    struct job *next;
+} job;
+
+// run_lock guards starting and stopping the workers, wake_lock the list
+// of active jobs
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t *workers = 0;
+static int nworkers = 0;
+static int budget = 0;
+static job *jobs = 0;
+static int stopping = 0;
+static __thread int in_parallel = 0;
+
+static void lock_deque(deque *d)
+{
+    while(atomic_flag_test_and_set_explicit(&d->lock, memory_order_acquire)) sched_yield();
+}
+
+static void unlock_deque(deque *d)
+{
+    atomic_flag_clear_explicit(&d->lock, memory_order_release);
+}
+
+// Take the last chunk of our own deque
+static int pop_chunk(deque *d)
+{
+    int c = -1;
+    lock_deque(d);
+    if(d->bottom > d->top) c = --d->bottom;
+    unlock_deque(d);
+    return c;
+}
+
+// Move the front half of a victim's chunks to our own empty deque
+static int steal_chunks(deque *victim, deque *mine)
+{
+    int top, mid;
+    lock_deque(victim);
+    top = victim->top;
+    mid = top + (victim->bottom - top + 1)/2;
+    victim->top = mid;
+    unlock_deque(victim);
+    if(mid <= top) return 0;
+    lock_deque(mine);
+    mine->top = top;
+    mine->bottom = mid;
+    unlock_deque(mine);
+    return 1;
+}
+
+static void run_chunk(job *j, int c, int worker)
+{
+    int i;
+    int start = (long long)j->n*c/j->chunks;
+    int end = (long long)j->n*(c+1)/j->chunks;
+    for(i = start; i < end; ++i) j->body(i, worker, j->ctx);
+}
+
+// Work on a job as participant p until no deque has anything left
+static void participate(job *j, int p)
+{
+    int c, k;
+    unsigned seed = p*2654435761u + 1;
+    in_parallel = 1;
+    for(;;){
+        while((c = pop_chunk(&j->deques[p])) >= 0) run_chunk(j, c, p);
+        // Start looking at a different victim each time so thieves spread out
+        seed = seed*1103515245u + 12345u;
+        int first = (seed >> 16) % j->participants;
+        int stolen = 0;
+        for(k = 0; k < j->participants && !stolen; ++k){
+            int v = (first + k) % j->participants;
+            if(v != p) stolen = steal_chunks(&j->deques[v], &j->deques[p]);
+        }
+        if(!stolen) break;
+    }
+    in_parallel = 0;
+    atomic_fetch_sub_explicit(&j->active, 1, memory_order_release);
+}
+
+// Take a free place in the active job with the fewest participants
+// Called with wake_lock held.
+// int *p: set to our participant id in the job
+// returns: job to work on, 0 if none needs help
+static job *join_job(int *p)
+{
+    job *j, *best = 0;
+    for(j = jobs; j; j = j->next){
+        if(j->joined >= j->participants) continue;
+        if(!best || atomic_load(&j->active) < atomic_load(&best->active)) best = j;
+    }
+    if(best){
+        *p = best->joined++;
+        atomic_fetch_add(&best->active, 1);
+    }
+    return best;
+}
+
+static void *worker_thread(void *ptr)
+{
+    int p;
+    job *j;
+    for(;;){
+        pthread_mutex_lock(&wake_lock);
+        while(!(j = join_job(&p)) && !stopping) pthread_cond_wait(&wake, &wake_lock);
+        pthread_mutex_unlock(&wake_lock);
+        // Finish the job we joined even when stopping, its caller counts on us
+        if(j) participate(j, p);
+        else return 0;
+    }
+}
+
+static int core_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+static void stop_workers()
+{
+    int i;
+    pthread_mutex_lock(&wake_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&wake_lock);
+    for(i = 0; i < nworkers; ++i) pthread_join(workers[i], 0);
+    free(workers);
+    workers = 0;
+    nworkers = 0;
+    stopping = 0;
+}
+
+// Hold the pool still across fork, and give the child an empty pool since
+// only the forking thread comes with it
+static void before_fork()
+{
+    pthread_mutex_lock(&run_lock);
+    pthread_mutex_lock(&wake_lock);
+}
+
+static void after_fork_parent()
+{
+    pthread_mutex_unlock(&wake_lock);
+    pthread_mutex_unlock(&run_lock);
+}
+
+static void after_fork_child()
+{
+    free(workers);
+    workers = 0;
+    nworkers = 0;
+    jobs = 0;
+    pthread_cond_init(&wake, 0);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_mutex_unlock(&run_lock);
+}
+
+// Start the pool's threads if the budget has changed
+// Called with run_lock held.
+static void start_workers()
+{
+    int i;
+    static int registered = 0;
+    int want = parallel_threads() - 1;
+    if(!registered){
+        pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+        registered = 1;
+    }
+    if(want == nworkers) return;
+    if(nworkers) stop_workers();
+    workers = calloc(want > 0 ? want : 1, sizeof(pthread_t));
+    for(i = 0; i < want; ++i){
+        if(pthread_create(&workers[i], 0, worker_thread, (void *)(size_t)i)) break;
+        ++nworkers;
+    }
+}
+
+// Set the most threads the library runs at once, the calling thread
+// included
+// int n: number of threads, 0 for one per core
+void set_num_threads(int n)
+{
+    pthread_mutex_lock(&run_lock);
+    budget = n > 0 ? n : 0;
+    if(nworkers) stop_workers();
+    pthread_mutex_unlock(&run_lock);
+}
+
+int parallel_threads()
+{
+    return budget ? budget : core_count();
+}
+
+// Run body(i, worker, ctx) for every i in [0, n)
+// int most: most participants to use, worker is always less than this
+static void run_job(int n, int most, void (*body)(int i, int worker, void *ctx), void *ctx)
+{
+    int p;
+    job **link;
+    if(n <= 0) return;
+    if(in_parallel || parallel_threads() == 1 || n == 1){
+        // Nested: this thread's core is already counted
+        int i;
+        for(i = 0; i < n; ++i) body(i, 0, ctx);
+        return;
+    }
+    pthread_mutex_lock(&run_lock);
+    start_workers();
+    job j;
+    j.n = n;
+    j.participants = nworkers + 1;
+    pthread_mutex_unlock(&run_lock);
+    if(j.participants > most) j.participants = most;
+    if(j.participants > n) j.participants = n;
+    j.chunks = j.participants*CHUNKS_PER_THREAD;
+    if(j.chunks > n) j.chunks = n;
+    j.body = body;
+    j.ctx = ctx;
+    j.deques = pool_calloc(j.participants, sizeof(deque));
+    for(p = 0; p < j.participants; ++p){
+        atomic_flag_clear(&j.deques[p].lock);
+        j.deques[p].top = (long long)j.chunks*p/j.participants;
+        j.deques[p].bottom = (long long)j.chunks*(p+1)/j.participants;
+    }
+    j.joined = 1;
+    atomic_init(&j.active, 1);
+
+    pthread_mutex_lock(&wake_lock);
+    j.next = jobs;
+    jobs = &j;
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&wake_lock);
+
+    participate(&j, 0);
+
+    // Nobody can join once the job is off the list, then wait for whoever
+    // is still running the last chunks
+    pthread_mutex_lock(&wake_lock);
+    for(link = &jobs; *link != &j; link = &(*link)->next);
+    *link = j.next;
+    pthread_mutex_unlock(&wake_lock);
+    while(atomic_load_explicit(&j.active, memory_order_acquire) > 0) sched_yield();
+    pool_free(j.deques);
+}
+
+typedef struct {
+    void (*fn)(int i, void *ctx);
+    void *ctx;
+} for_args;
+
+static void for_body(int i, int worker, void *ctx)
+{
+    for_args *a = ctx;
+    a->fn(i, a->ctx);
+}
+
+void parallel_for(int n, void (*fn)(int i, void *ctx), void *ctx)
+{
+    for_args a = {fn, ctx};
+    run_job(n, n, for_body, &a);
+}
+
+typedef struct {
+    void (*fn)(int i, void *ctx);
+    void *ctx;
+    int i;
+} thread_args;
+
+static void *run_thread(void *ptr)
+{
+    thread_args *a = ptr;
+    in_parallel = 1;
+    a->fn(a->i, a->ctx);
+    return 0;
+}
+
+void run_threads(int n, void (*fn)(int i, void *ctx), void *ctx)
+{
+    int i;
+    if(n <= 0) return;
+    pthread_t *threads = calloc(n, sizeof(pthread_t));
+    thread_args *args = calloc(n, sizeof(thread_args));
+    for(i = 1; i < n; ++i){
+        args[i] = (thread_args){fn, ctx, i};
+        if(pthread_create(&threads[i], 0, run_thread, &args[i])){
+            fprintf(stderr, "Couldn't start thread %d\n", i);
+            exit(-1);
+        }
+    }
+    int was = in_parallel;
+    in_parallel = 1;
+    fn(0, ctx);
+    in_parallel = was;
+    for(i = 1; i < n; ++i) pthread_join(threads[i], 0);
+    free(args);
+    free(threads);
+}
+
+typedef struct {
+    void (*fn)(int i, float *acc, void *ctx);
+    void *ctx;
+    float **accs;
+    float *out;
+    int size;
+    int workers;
+} reduce_args;
+
+static void reduce_body(int i, int worker, void *ctx)
+{
+    reduce_args *a = ctx;
+    a->fn(i, a->accs[worker], a->ctx);
+}
+
+// Floats of the accumulators summed per task at the end of a reduction
+#define REDUCE_BLOCK 4096
+
+static void sum_block(int b, void *ctx)
+{
+    reduce_args *a = ctx;
+    int t, k;
+    int start = b*REDUCE_BLOCK;
+    int end = (start + REDUCE_BLOCK < a->size) ? start + REDUCE_BLOCK : a->size;
+    float *restrict out = a->out;
+    for(t = 0; t < a->workers; ++t){
+        const float *restrict acc = a->accs[t];
+        for(k = start; k < end; ++k) out[k] += acc[k];
+    }
+}
+
+void parallel_reduce(int n, int size, void (*fn)(int i, float *acc, void *ctx), float *out, void *ctx)
+{
+    int t;
+    // Nested reductions run on this thread alone, so only need one
+    reduce_args a = {fn, ctx, 0, out, size, in_parallel ? 1 : parallel_threads()};
+    // Separate pool blocks start on their own cache lines, so threads
+    // never write to the same line
+    a.accs = pool_calloc(a.workers, sizeof(float *));
+    for(t = 0; t < a.workers; ++t) a.accs[t] = pool_calloc(size, sizeof(float));
+    run_job(n, a.workers, reduce_body, &a);
+    parallel_for((size + REDUCE_BLOCK - 1)/REDUCE_BLOCK, sum_block, &a);
+    for(t = 0; t < a.workers; ++t) pool_free(a.accs[t]);
+    pool_free(a.accs);
+}
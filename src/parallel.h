@@ -0,0 +1,37 @@
+// Include guards and C++ compatibility
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Run fn(i, ctx) for every i in [0, n) spread across worker threads
+// Returns once every call has finished. Calls may run in any order.
+// Loops started inside another loop run on the calling thread.
+// int n: number of iterations
+// void (*fn)(int i, void *ctx): body of the loop
+// void *ctx: passed through to fn
+void parallel_for(int n, void (*fn)(int i, void *ctx), void *ctx);
+
+// Run fn(i, acc, ctx) for every i in [0, n) and add up what they write
+// Each thread gets its own zeroed accumulator of size floats, which are
+// summed into out when the loop is done.
+// float *out: size floats to add the sums into
+void parallel_reduce(int n, int size, void (*fn)(int i, float *acc, void *ctx), float *out, void *ctx);
+
+// Run fn(i, ctx) for every i in [0, n) each on its own thread, all at once
+// For work that needs its calls running side by side rather than just
+// done. The calling thread runs i = 0, and loops inside fn run on the
+// thread that calls them.
+void run_threads(int n, void (*fn)(int i, void *ctx), void *ctx);
+
+// Set the most threads the library runs at once, 0 for one per core
+void set_num_threads(int n);
+
+// Number of threads parallel loops spread work across
+int parallel_threads();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+#define POOL_ALIGN 64
+#define POOL_MIN_BLOCK 128
+#define POOL_CLASSES 192
+#define POOL_HUGE_SIZE (2<<20)
+#define POOL_THREAD_BLOCKS 4
+#define POOL_MAX_CACHED ((size_t)1<<30)
+#define POOL_MAGIC 0x75776e6574706f6fULL
+
+// Every block starts with a header that takes up one cache line, the
+// caller gets the memory right after it so alignment is preserved.
+typedef union block{
+    struct {
+        size_t magic;
+        size_t bytes;
+        size_t size;
+        int cls;
+        int mapped;
+        union block *next;
+    };
+    char pad[POOL_ALIGN];
+} block;
+
+typedef struct {
+    block *free[POOL_CLASSES];
+    int count[POOL_CLASSES];
+} thread_cache;
+
+static block *global_free[POOL_CLASSES];
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t global_cached = 0;
+
+static atomic_size_t live_bytes;
+static atomic_size_t peak_bytes;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static __thread thread_cache *local_cache = 0;
+
+// Find the size class for a block of a given size
+// Classes go up in quarter steps between powers of two so at most
+// 25% of a block is wasted.
+// size_t bytes: total bytes needed, including header
+// size_t *class_size: set to the size of blocks in this class
+// returns: index of size class
+static int size_class(size_t bytes, size_t *class_size)
+{
+    if(bytes <= POOL_MIN_BLOCK){
+        *class_size = POOL_MIN_BLOCK;
+        return 0;
+    }
+    int k = 63 - __builtin_clzll(bytes - 1);
+    size_t base = (size_t)1 << k;
+    size_t step = base / 4;
+    size_t q = (bytes - base + step - 1) / step;
+    *class_size = base + q*step;
+    return (k - 7)*4 + (int)q;
+}
+
+static block *system_alloc(size_t size)
+{
+    block *b = 0;
+    if(size >= POOL_HUGE_SIZE){
+        // Over-map so we can trim to a huge page boundary
+        size_t len = (size + POOL_HUGE_SIZE - 1) & ~((size_t)POOL_HUGE_SIZE - 1);
+        char *p = mmap(0, len + POOL_HUGE_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) return 0;
+        char *start = (char *)(((size_t)p + POOL_HUGE_SIZE - 1) & ~((size_t)POOL_HUGE_SIZE - 1));
+        if(start > p) munmap(p, start - p);
+        if(start + len < p + len + POOL_HUGE_SIZE) munmap(start + len, p + len + POOL_HUGE_SIZE - (start + len));
+#ifdef MADV_HUGEPAGE
+        madvise(start, len, MADV_HUGEPAGE);
+#endif
+        b = (block *)start;
+        b->mapped = 1;
+    } else {
+        if(posix_memalign((void **)&b, POOL_ALIGN, size)) return 0;
+        b->mapped = 0;
+    }
+    b->magic = POOL_MAGIC;
+    b->size = size;
+    return b;
+}
+
+static void system_free(block *b)
+{
+    if(b->mapped){
+        size_t len = (b->size + POOL_HUGE_SIZE - 1) & ~((size_t)POOL_HUGE_SIZE - 1);
+        munmap(b, len);
+    } else {
+        free(b);
+    }
+}
+
+static void flush_cache(void *p)
+{
+    thread_cache *tc = p;
+    int i;
+    pthread_mutex_lock(&global_lock);
+    for(i = 0; i < POOL_CLASSES; ++i){
+        while(tc->free[i]){
+            block *b = tc->free[i];
+            tc->free[i] = b->next;
+            b->next = global_free[i];
+            global_free[i] = b;
+            global_cached += b->size;
+        }
+        tc->count[i] = 0;
+    }
+    pthread_mutex_unlock(&global_lock);
+}
+
+static void release_cache(void *p)
+{
+    flush_cache(p);
+    free(p);
+}
+
+static void make_cache_key()
+{
+    pthread_key_create(&cache_key, release_cache);
+}
+
+static thread_cache *get_cache()
+{
+    if(!local_cache){
+        pthread_once(&cache_once, make_cache_key);
+        local_cache = calloc(1, sizeof(thread_cache));
+        pthread_setspecific(cache_key, local_cache);
+    }
+    return local_cache;
+}
+
+static void add_live(size_t bytes)
+{
+    size_t live = atomic_fetch_add(&live_bytes, bytes) + bytes;
+    size_t peak = atomic_load(&peak_bytes);
+    while(live > peak && !atomic_compare_exchange_weak(&peak_bytes, &peak, live));
+}
+
+void *pool_calloc(size_t n, size_t size)
+{
+    size_t bytes = n*size;
+    size_t class_size;
+    int cls = size_class(bytes + sizeof(block), &class_size);
+    assert(cls < POOL_CLASSES);
+    thread_cache *tc = get_cache();
+
+    block *b = tc->free[cls];
+    if(b){
+        tc->free[cls] = b->next;
+        --tc->count[cls];
+    } else {
+        pthread_mutex_lock(&global_lock);
+        b = global_free[cls];
+        if(b){
+            global_free[cls] = b->next;
+            global_cached -= b->size;
+        }
+        pthread_mutex_unlock(&global_lock);
+    }
+
+    if(b){
+        memset(b + 1, 0, bytes);
+    } else {
+        b = system_alloc(class_size);
+        if(!b){
+            fprintf(stderr, "pool allocation of %zu bytes failed\n", bytes);
+            exit(-1);
+        }
+        // Fresh mappings are already zero, no need to touch every page
+        if(!b->mapped) memset(b + 1, 0, bytes);
+    }
+    b->cls = cls;
+    b->bytes = bytes;
+    b->next = 0;
+    add_live(bytes);
+    return b + 1;
+}
+
+void pool_free(void *p)
+{
+    if(!p) return;
+    block *b = (block *)p - 1;
+    assert(b->magic == POOL_MAGIC);
+    atomic_fetch_sub(&live_bytes, b->bytes);
+
+    int cls = b->cls;
+    thread_cache *tc = get_cache();
+    if(tc->count[cls] < POOL_THREAD_BLOCKS){
+        b->next = tc->free[cls];
+        tc->free[cls] = b;
+        ++tc->count[cls];
+        return;
+    }
+
+    pthread_mutex_lock(&global_lock);
+    if(global_cached + b->size <= POOL_MAX_CACHED){
+        b->next = global_free[cls];
+        global_free[cls] = b;
+        global_cached += b->size;
+        b = 0;
+    }
+    pthread_mutex_unlock(&global_lock);
+    if(b) system_free(b);
+}
+
+void pool_trim()
+{
+    int i;
+    if(local_cache) flush_cache(local_cache);
+    pthread_mutex_lock(&global_lock);
+    for(i = 0; i < POOL_CLASSES; ++i){
+        while(global_free[i]){
+            block *b = global_free[i];
+            global_free[i] = b->next;
+            system_free(b);
+        }
+    }
+    global_cached = 0;
+    pthread_mutex_unlock(&global_lock);
+}
+
+size_t pool_live_bytes()
+{
+    return atomic_load(&live_bytes);
+}
+
+size_t pool_peak_bytes()
+{
+    return atomic_load(&peak_bytes);
+}
+
+void print_pool_stats()
+{
+    pthread_mutex_lock(&global_lock);
+    size_t cached = global_cached;
+    pthread_mutex_unlock(&global_lock);
+    fprintf(stderr, "Pool: %.2f MB live, %.2f MB peak, %.2f MB cached\n",
+            pool_live_bytes()/1048576., pool_peak_bytes()/1048576., cached/1048576.);
+}
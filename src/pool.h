@@ -0,0 +1,40 @@
+// Include guards and C++ compatibility
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pooled allocator for matrix and image buffers.
+// Blocks are grouped into size classes and recycled through per-thread
+// and global free lists, so the same sizes allocated over and over in a
+// training loop don't go back to the system every iteration.
+// All memory is 64-byte aligned, large blocks are backed by huge pages.
+
+// Allocate zeroed memory from the pool
+// size_t n: number of elements
+// size_t size: size of each element
+// returns: pointer to n*size zeroed bytes, 64-byte aligned
+void *pool_calloc(size_t n, size_t size);
+
+// Return memory to the pool
+// void *p: pointer from pool_calloc, or 0
+void pool_free(void *p);
+
+// Release all cached free blocks back to the system
+void pool_trim();
+
+// Bytes currently handed out by the pool
+size_t pool_live_bytes();
+
+// Largest value pool_live_bytes has reached
+size_t pool_peak_bytes();
+
+// Print live, peak and cached bytes
+void print_pool_stats();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "uwnet.h"
+#include "parallel.h"
+
+// Floats of a gradient reduced at a time, small enough to stay in cache
+// while every replica's copy is added in
+#define REDUCE_CHUNK 4096
+
+// From classifier.c
+float batch_gradient(net m, data b);
+
+// Make a copy of a net that shares its weights and biases
+// The copy has its own saved inputs, gradients and batchnorm statistics,
+// so several threads can each run part of a batch through their own copy.
+// returns: replica to free with free_replica
+net replicate_net(net m)
+{
+    int i;
+    net r;
+    r.n = m.n;
+    r.layers = calloc(m.n, sizeof(layer));
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        layer c = l;
+        c.x = calloc(1, sizeof(matrix));
+        if(l.dw.data) c.dw = make_matrix(l.dw.rows, l.dw.cols);
+        if(l.db.data) c.db = make_matrix(l.db.rows, l.db.cols);
+        if(l.rolling_mean.data) c.rolling_mean = copy_matrix(l.rolling_mean);
+        if(l.rolling_variance.data) c.rolling_variance = copy_matrix(l.rolling_variance);
+        r.layers[i] = c;
+    }
+    return r;
+}
+
+void free_replica(net r)
+{
+    int i;
+    for(i = 0; i < r.n; ++i){
+        layer l = r.layers[i];
+        free_matrix(l.dw);
+        free_matrix(l.db);
+        free_matrix(l.rolling_mean);
+        free_matrix(l.rolling_variance);
+        free_matrix(*l.x);
+        free(l.x);
+    }
+    free(r.layers);
+}
+
+// One gradient (a dw or db) of the master net and its copy in each replica
+typedef struct {
+    float *master;
+    float **parts;
+    size_t size;
+} gradient;
+
+typedef struct {
+    int grad;
+    size_t start, size;
+} reduce_chunk;
+
+// Loss of one thread's part of the batch, a cache line each so threads
+// don't fight over the line
+typedef struct {
+    float loss;
+    char pad[60];
+} part_loss;
+
+typedef struct {
+    net m;
+    net *replicas;
+    int threads;
+    gradient *grads;
+    int ngrads;
+    reduce_chunk *chunks;
+    int nchunks;
+    data batch;
+    part_loss *losses;
+} trainer;
+
+static void add_gradient(gradient *g, matrix master, net *replicas, int threads, int i, int bias)
+{
+    int t;
+    g->master = master.data;
+    g->size = (size_t)master.rows*master.ld;
+    g->parts = calloc(threads, sizeof(float *));
+    for(t = 0; t < threads; ++t){
+        layer l = replicas[t].layers[i];
+        g->parts[t] = bias ? l.db.data : l.dw.data;
+    }
+}
+
+// List every gradient and split them into chunks for the reduction
+static void plan_reduction(trainer *tr)
+{
+    int i, k;
+    net m = tr->m;
+    tr->grads = calloc(2*m.n, sizeof(gradient));
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        if(l.dw.data) add_gradient(&tr->grads[tr->ngrads++], l.dw, tr->replicas, tr->threads, i, 0);
+        if(l.db.data) add_gradient(&tr->grads[tr->ngrads++], l.db, tr->replicas, tr->threads, i, 1);
+    }
+    for(k = 0; k < 2; ++k){
+        tr->nchunks = 0;
+        for(i = 0; i < tr->ngrads; ++i){
+            size_t start;
+            for(start = 0; start < tr->grads[i].size; start += REDUCE_CHUNK){
+                if(k){
+                    reduce_chunk c = {i, start, tr->grads[i].size - start};
+                    if(c.size > REDUCE_CHUNK) c.size = REDUCE_CHUNK;
+                    tr->chunks[tr->nchunks] = c;
+                }
+                ++tr->nchunks;
+            }
+        }
+        if(!k) tr->chunks = calloc(tr->nchunks, sizeof(reduce_chunk));
+    }
+}
+
+// Sum one chunk of every replica's gradient into the master and clear them
+// Replicas are added in pairs, then pairs of pairs, so the chunk is read
+// from each replica once and the sums stay balanced.
+static void reduce(int k, void *ptr)
+{
+    trainer *tr = ptr;
+    int s, t;
+    size_t i;
+    reduce_chunk c = tr->chunks[k];
+    gradient g = tr->grads[c.grad];
+    for(s = 1; s < tr->threads; s *= 2){
+        for(t = 0; t + s < tr->threads; t += 2*s){
+            float *restrict a = g.parts[t] + c.start;
+            float *restrict b = g.parts[t+s] + c.start;
+            for(i = 0; i < c.size; ++i) a[i] += b[i];
+            memset(b, 0, c.size*sizeof(float));
+        }
+    }
+    float *restrict a = g.parts[0] + c.start;
+    float *restrict out = g.master + c.start;
+    for(i = 0; i < c.size; ++i) out[i] += a[i];
+    memset(a, 0, c.size*sizeof(float));
+}
+
+// Run part t of a batch through replica t
+// Layers called from here run on this thread alone, the parts are what
+// get spread across the worker threads.
+static void train_part(int t, void *ptr)
+{
+    trainer *tr = ptr;
+    data b = tr->batch;
+    int start = (long long)b.x.rows*t/tr->threads;
+    int end = (long long)b.x.rows*(t+1)/tr->threads;
+    data part = view_data(b, start, end - start);
+    tr->losses[t].loss = batch_gradient(tr->replicas[t], part)*part.x.rows;
+}
+
+// Average the replicas' batchnorm statistics back into the master
+static void merge_statistics(net m, net *replicas, int threads)
+{
+    int i, t;
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        if(!l.rolling_mean.data) continue;
+        scal_matrix(0, l.rolling_mean);
+        scal_matrix(0, l.rolling_variance);
+        for(t = 0; t < threads; ++t){
+            axpy_matrix(1./threads, replicas[t].layers[i].rolling_mean, l.rolling_mean);
+            axpy_matrix(1./threads, replicas[t].layers[i].rolling_variance, l.rolling_variance);
+        }
+    }
+}
+
+// Train a classifier with each batch split across several threads
+// Every part of the batch runs through its own replica of the net, then
+// the threads sum the replicas' gradients into the net together and it
+// is updated once, just like train_image_classifier. Batchnorm layers
+// use each part of the batch for their statistics.
+// int threads: parts to split batches into, 0 for one per core
+void train_image_classifier_parallel(net m, data d, int batch, int iters, float rate, float momentum, float decay, int threads)
+{
+    int e, t;
+    if(threads <= 0) threads = parallel_threads();
+    // Batchnorm treats a single row as inference, keep at least two per part
+    if(threads > batch/2) threads = batch/2;
+    if(threads <= 1){
+        train_image_classifier(m, d, batch, iters, rate, momentum, decay);
+        return;
+    }
+
+    trainer tr = {0};
+    tr.m = m;
+    tr.threads = threads;
+    tr.replicas = calloc(threads, sizeof(net));
+    for(t = 0; t < threads; ++t) tr.replicas[t] = replicate_net(m);
+    tr.losses = calloc(threads, sizeof(part_loss));
+    plan_reduction(&tr);
+
+    loader *l = start_loader(d, batch, rand_seed());
+    for(e = 0; e < iters; ++e){
+        tr.batch = loader_next(l);
+        parallel_for(threads, train_part, &tr);
+        parallel_for(tr.nchunks, reduce, &tr);
+        float err = 0;
+        for(t = 0; t < threads; ++t) err += tr.losses[t].loss;
+        fprintf(stderr, "%06d: Loss: %f\n", e, err/tr.batch.x.rows);
+        update_net(m, rate/batch, momentum, decay);
+    }
+    stop_loader(l);
+
+    merge_statistics(m, tr.replicas, threads);
+    for(t = 0; t < threads; ++t) free_replica(tr.replicas[t]);
+    for(t = 0; t < tr.ngrads; ++t) free(tr.grads[t].parts);
+    free(tr.grads);
+    free(tr.chunks);
+    free(tr.losses);
+    free(tr.replicas);
+}
+
+typedef struct {
+    net *replicas;
+    unsigned long long *seeds;
+    data d;
+    int batch, iters;
+    float rate, momentum, decay;
+    atomic_int next;
+} hogwild;
+
+// Train replica t on its own batches until the iterations run out
+// Only thread 0 reports its loss, so the log reads like a single thread's.
+static void hogwild_worker(int t, void *ptr)
+{
+    hogwild *h = ptr;
+    int e;
+    loader *l = start_loader(h->d, h->batch, h->seeds[t]);
+    while((e = atomic_fetch_add(&h->next, 1)) < h->iters){
+        data b = loader_next(l);
+        float err = batch_gradient(h->replicas[t], b);
+        if(!t) fprintf(stderr, "%06d: Loss: %f\n", e, err);
+        update_net(h->replicas[t], h->rate/h->batch, h->momentum, h->decay);
+    }
+    stop_loader(l);
+}
+
+// Train a classifier with several threads updating its weights at once
+// Each thread draws its own batches and updates the shared weights and
+// biases without locking, as in Hogwild!. Updates can overwrite each other
+// but threads never wait on each other. Each thread keeps its own
+// momentum in its replica's dw and db. iters counts batches across all
+// threads.
+// int threads: threads to use, 0 for one per core
+void train_image_classifier_hogwild(net m, data d, int batch, int iters, float rate, float momentum, float decay, int threads)
+{
+    int t;
+    if(threads <= 0 || threads > parallel_threads()) threads = parallel_threads();
+    if(threads <= 1){
+        train_image_classifier(m, d, batch, iters, rate, momentum, decay);
+        return;
+    }
+
+    hogwild h = {0};
+    h.replicas = calloc(threads, sizeof(net));
+    h.seeds = calloc(threads, sizeof(unsigned long long));
+    for(t = 0; t < threads; ++t){
+        h.replicas[t] = replicate_net(m);
+        h.seeds[t] = rand_seed();
+    }
+    h.d = d;
+    h.batch = batch;
+    h.iters = iters;
+    h.rate = rate;
+    h.momentum = momentum;
+    h.decay = decay;
+    atomic_init(&h.next, 0);
+    // Every thread has to be running at once for Hogwild!, not just finish
+    run_threads(threads, hogwild_worker, &h);
+
+    merge_statistics(m, h.replicas, threads);
+    for(t = 0; t < threads; ++t) free_replica(h.replicas[t]);
+    free(h.replicas);
+    free(h.seeds);
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "uwnet.h"
+
+// Processes in a ring each hold a socket to the next process and one from
+// the previous. A sum is done in two laps of the ring: the vector is cut
+// into one chunk per process, and in the first lap every process adds the
+// chunk coming in to its own and passes it on, so each chunk ends up fully
+// summed on one process. In the second lap the summed chunks are passed
+// around again and copied. Every process sends and receives 2(p-1)/p of
+// the vector however many processes there are.
+//
+// The sockets are plain stream sockets, so Unix sockets here could be
+// swapped for TCP ones to span machines.
+
+// Seconds to keep trying to reach the next process while it starts up
+#define RING_CONNECT_TIMEOUT 60
+
+struct ring{
+    int rank, size;
+    int next, prev;
+    float *scratch;
+    size_t scratch_size;
+};
+
+// From classifier.c
+float batch_gradient_hook(net m, data b, void (*done)(int i, void *ctx), void *ctx);
+
+static void ring_error(ring *r, char *what)
+{
+    fprintf(stderr, "Ring rank %d: %s: %s\n", r->rank, what, strerror(errno));
+    exit(-1);
+}
+
+static struct sockaddr_un ring_address(char *path, int rank)
+{
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%d", path, rank);
+    return addr;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = {0, ms*1000000L};
+    nanosleep(&ts, 0);
+}
+
+// Send and receive at once, so neighbours sending big chunks to each other
+// never both block on a full socket
+static void exchange(ring *r, const void *out, size_t out_size, void *in, size_t in_size)
+{
+    size_t sent = 0, got = 0;
+    while(sent < out_size || got < in_size){
+        struct pollfd fds[2];
+        int n = 0;
+        if(sent < out_size) fds[n++] = (struct pollfd){r->next, POLLOUT, 0};
+        if(got < in_size) fds[n++] = (struct pollfd){r->prev, POLLIN, 0};
+        if(poll(fds, n, -1) < 0){
+            if(errno == EINTR) continue;
+            ring_error(r, "poll");
+        }
+        if(sent < out_size && fds[0].revents){
+            ssize_t k = send(r->next, (char *)out + sent, out_size - sent, MSG_NOSIGNAL);
+            if(k < 0 && errno != EAGAIN && errno != EINTR) ring_error(r, "send");
+            if(k > 0) sent += k;
+        }
+        if(got < in_size && fds[n-1].revents){
+            ssize_t k = recv(r->prev, (char *)in + got, in_size - got, 0);
+            if(k == 0){
+                errno = ECONNRESET;
+                ring_error(r, "recv");
+            }
+            if(k < 0 && errno != EAGAIN && errno != EINTR) ring_error(r, "recv");
+            if(k > 0) got += k;
+        }
+    }
+}
+
+// Join a ring of processes on one machine
+// Every process calls this with the same path and size and its own rank.
+// Returns once the ring is complete.
+// char *path: prefix for the ring's socket files, rank i listens on path.i
+// int rank: this process's place in the ring, 0 to size-1
+// int size: number of processes
+// returns: ring to pass to ring_allreduce, close with leave_ring
+ring *join_ring(char *path, int rank, int size)
+{
+    int i;
+    ring *r = calloc(1, sizeof(ring));
+    r->rank = rank;
+    r->size = size;
+    r->next = r->prev = -1;
+    if(size <= 1) return r;
+
+    struct sockaddr_un self = ring_address(path, rank);
+    struct sockaddr_un next = ring_address(path, (rank + 1) % size);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) ring_error(r, "socket");
+    unlink(self.sun_path);
+    if(bind(listener, (struct sockaddr *)&self, sizeof(self))) ring_error(r, self.sun_path);
+    if(listen(listener, 1)) ring_error(r, "listen");
+
+    // The next process may not be listening yet
+    r->next = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(r->next < 0) ring_error(r, "socket");
+    for(i = 0; connect(r->next, (struct sockaddr *)&next, sizeof(next)); ++i){
+        if((errno != ENOENT && errno != ECONNREFUSED) || i >= RING_CONNECT_TIMEOUT*100){
+            ring_error(r, next.sun_path);
+        }
+        sleep_ms(10);
+    }
+    r->prev = accept(listener, 0, 0);
+    if(r->prev < 0) ring_error(r, "accept");
+    close(listener);
+    unlink(self.sun_path);
+
+    // Make sure the previous process is who we think it is
+    int theirs = -1;
+    exchange(r, &rank, sizeof(int), &theirs, sizeof(int));
+    if(theirs != (rank + size - 1) % size){
+        fprintf(stderr, "Ring rank %d: expected rank %d before us, got %d\n", rank, (rank + size - 1) % size, theirs);
+        exit(-1);
+    }
+    fcntl(r->next, F_SETFL, fcntl(r->next, F_GETFL) | O_NONBLOCK);
+    fcntl(r->prev, F_SETFL, fcntl(r->prev, F_GETFL) | O_NONBLOCK);
+    return r;
+}
+
+void leave_ring(ring *r)
+{
+    if(!r) return;
+    if(r->next >= 0) close(r->next);
+    if(r->prev >= 0) close(r->prev);
+    free(r->scratch);
+    free(r);
+}
+
+int ring_rank(ring *r)
+{
+    return r->rank;
+}
+
+int ring_size(ring *r)
+{
+    return r->size;
+}
+
+// Sum a vector across every process in the ring, in place
+// Every process ends up with exactly the same sums.
+// float *x: this process's vector, replaced with the sum
+// size_t n: length of x, the same on every process
+void ring_allreduce(ring *r, float *x, size_t n)
+{
+    int s;
+    size_t i;
+    int p = r->size;
+    if(p <= 1 || !n) return;
+    size_t most = (n + p - 1)/p;
+    if(r->scratch_size < most){
+        free(r->scratch);
+        r->scratch = malloc(most*sizeof(float));
+        r->scratch_size = most;
+    }
+
+    // Chunk c is x[n*c/p, n*(c+1)/p)
+    #define CHUNK_START(c) (n*(size_t)(c)/p)
+    #define CHUNK_SIZE(c) (CHUNK_START((c)+1) - CHUNK_START(c))
+
+    // First lap: after it, chunk rank+1 holds the sum from every process
+    for(s = 0; s < p - 1; ++s){
+        int out = (r->rank - s + p) % p;
+        int in = (r->rank - s - 1 + p) % p;
+        exchange(r, x + CHUNK_START(out), CHUNK_SIZE(out)*sizeof(float), r->scratch, CHUNK_SIZE(in)*sizeof(float));
+        float *restrict xi = x + CHUNK_START(in);
+        const float *restrict add = r->scratch;
+        for(i = 0; i < CHUNK_SIZE(in); ++i) xi[i] += add[i];
+    }
+
+    // Second lap: pass the finished chunks around
+    for(s = 0; s < p - 1; ++s){
+        int out = (r->rank + 1 - s + p) % p;
+        int in = (r->rank - s + p) % p;
+        exchange(r, x + CHUNK_START(out), CHUNK_SIZE(out)*sizeof(float), x + CHUNK_START(in), CHUNK_SIZE(in)*sizeof(float));
+    }
+    #undef CHUNK_START
+    #undef CHUNK_SIZE
+}
+
+// Average a matrix across the ring
+static void ring_average(ring *r, matrix m)
+{
+    if(!m.data) return;
+    ring_allreduce(r, m.data, (size_t)m.rows*m.ld);
+    scal_matrix(1./r->size, m);
+}
+
+// Give every process the net of rank 0
+// Other ranks zero their copy and add in rank 0's.
+void ring_sync_net(ring *r, net m)
+{
+    int i, k;
+    for(i = 0; i < m.n; ++i){
+        layer l = m.layers[i];
+        matrix parts[] = {l.w, l.dw, l.b, l.db, l.rolling_mean, l.rolling_variance};
+        for(k = 0; k < 6; ++k){
+            matrix p = parts[k];
+            if(!p.data) continue;
+            if(r->rank) scal_matrix(0, p);
+            ring_allreduce(r, p.data, (size_t)p.rows*p.ld);
+        }
+    }
+}
+
+// Background thread that averages each layer's gradients as soon as
+// backward is done with the layer, while it goes on to the layers before
+typedef struct {
+    ring *r;
+    net m;
+    int *queue;
+    int posted, reduced;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} overlap;
+
+static void *overlap_thread(void *ptr)
+{
+    overlap *o = ptr;
+    pthread_mutex_lock(&o->lock);
+    for(;;){
+        while(o->reduced == o->posted && !o->stop) pthread_cond_wait(&o->cond, &o->lock);
+        if(o->reduced == o->posted) break;
+        layer l = o->m.layers[o->queue[o->reduced]];
+        pthread_mutex_unlock(&o->lock);
+        ring_average(o->r, l.dw);
+        ring_average(o->r, l.db);
+        pthread_mutex_lock(&o->lock);
+        ++o->reduced;
+        pthread_cond_broadcast(&o->cond);
+    }
+    pthread_mutex_unlock(&o->lock);
+    return 0;
+}
+
+static void post_layer(int i, void *ptr)
+{
+    overlap *o = ptr;
+    layer l = o->m.layers[i];
+    if(!l.dw.data && !l.db.data) return;
+    pthread_mutex_lock(&o->lock);
+    o->queue[o->posted++] = i;
+    pthread_cond_broadcast(&o->cond);
+    pthread_mutex_unlock(&o->lock);
+}
+
+// Wait until every posted layer is averaged and start the next batch
+static void finish_step(overlap *o)
+{
+    pthread_mutex_lock(&o->lock);
+    while(o->reduced < o->posted) pthread_cond_wait(&o->cond, &o->lock);
+    o->posted = o->reduced = 0;
+    pthread_mutex_unlock(&o->lock);
+}
+
+// Train a classifier on this process's shard of a data set, averaging
+// gradients with the rest of the ring every batch
+// Every process in the ring calls this with the same net shape, data set
+// and settings. They start from rank 0's weights and stay in step, each
+// batch acting like one batch of batch*size examples. Each layer's
+// gradients go around the ring while backward runs the layers below it.
+// ring *r: ring from join_ring
+void train_image_classifier_ring(net m, data d, int batch, int iters, float rate, float momentum, float decay, ring *r)
+{
+    int e, i;
+    ring_sync_net(r, m);
+    int start = (long long)d.x.rows*r->rank/r->size;
+    int end = (long long)d.x.rows*(r->rank + 1)/r->size;
+    loader *l = start_loader(view_data(d, start, end - start), batch, r->rank);
+
+    overlap o = {0};
+    o.r = r;
+    o.m = m;
+    o.queue = calloc(m.n, sizeof(int));
+    pthread_mutex_init(&o.lock, 0);
+    pthread_cond_init(&o.cond, 0);
+    if(pthread_create(&o.thread, 0, overlap_thread, &o)){
+        fprintf(stderr, "Couldn't start ring thread\n");
+        exit(-1);
+    }
+
+    for(e = 0; e < iters; ++e){
+        data b = loader_next(l);
+        float err = batch_gradient_hook(m, b, post_layer, &o);
+        finish_step(&o);
+        if(!r->rank) fprintf(stderr, "%06d: Loss: %f\n", e, err);
+        update_net(m, rate/batch, momentum, decay);
+    }
+
+    pthread_mutex_lock(&o.lock);
+    o.stop = 1;
+    pthread_cond_broadcast(&o.cond);
+    pthread_mutex_unlock(&o.lock);
+    pthread_join(o.thread, 0);
+    pthread_mutex_destroy(&o.lock);
+    pthread_cond_destroy(&o.cond);
+    free(o.queue);
+    stop_loader(l);
+
+    // Batchnorm statistics saw different shards, average them
+    for(i = 0; i < m.n; ++i){
+        ring_average(r, m.layers[i].rolling_mean);
+        ring_average(r, m.layers[i].rolling_variance);
+    }
+}
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "uwnet.h"
+
+// A parameter server keeps a net's weights and biases in a named shared
+// memory segment. The serving process owns the real net: it takes one
+// gradient at a time from the workers, updates with it and publishes the
+// new weights. Workers copy out the latest weights, run a batch backward
+// and drop the gradient in their own slot, then go on without waiting
+// for anyone else.
+//
+// Weights are published into two buffers in turn, each behind a sequence
+// number that is odd while it is being written, so a worker copying one
+// out can tell if it was written under it. A gradient computed from
+// weights more than the staleness bound behind the current ones is thrown
+// away rather than applied.
+//
+// Each worker stamps its slot with the time every batch and marks it when
+// it leaves. The server gives up once every worker that joined has left
+// or gone quiet, or when nobody joins at all.
+
+#define PS_MAGIC 0x7077656e73727672ULL
+
+// Slot states
+#define SLOT_EMPTY 0
+#define SLOT_FULL 1
+
+typedef struct {
+    atomic_int state;
+    int sparse;                 // count index, value pairs instead of count floats
+    unsigned long long base;    // version of the weights the gradient came from
+    size_t count;
+    atomic_llong beat;          // when the worker was last heard from, in ms
+    atomic_int gone;            // set when the worker has left
+    char pad[28];
+} slot_header;
+
+typedef struct {
+    atomic_ullong magic;        // set last, once the segment is ready
+    size_t n;                   // floats of weights and biases
+    int workers;
+    int staleness;
+    atomic_int joined;
+    atomic_int done;
+    atomic_ullong version;
+    atomic_ullong seq[2];
+    size_t weights[2];          // offsets of the weight buffers
+    size_t slots;               // offset of the first slot
+    size_t slot_size;
+    size_t size;
+    long long applied, dropped, sparse;
+} ps_header;
+
+struct param_server{
+    char name[64];
+    char *map;
+    size_t size;
+    int owner;
+    int worker;
+    int timeout;
+    float *flat;
+};
+
+// From classifier.c
+float batch_gradient(net m, data b);
+
+// Seconds a worker waits for the server's segment to show up
+#define PS_CONNECT_TIMEOUT 60
+// Seconds the server waits to hear from a worker before counting it dead
+#define PS_WORKER_TIMEOUT 60
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+static ps_header *header(param_server *s)
+{
+    return (ps_header *)s->map;
+}
+
+static slot_header *get_slot(param_server *s, int i)
+{
+    ps_header *h = header(s);
+    return (slot_header *)(s->map + h->slots + i*h->slot_size);
+}
+
+static void backoff(int *spins)
+{
+    if(*spins < 64){
+        ++*spins;
+        sched_yield();
+    } else {
+        struct timespec ts = {0, 50000};
+        nanosleep(&ts, 0);
+    }
+}
+
+// Matrix k of a layer's parameters: w, b or their gradients
+static matrix layer_param(layer l, int k, int grads)
+{
+    if(k == 0) return grads ? l.dw : l.w;
+    return grads ? l.db : l.b;
+}
+
+static size_t count_params(net m)
+{
+    int i, k;
+    size_t n = 0;
+    for(i = 0; i < m.n; ++i){
+        for(k = 0; k < 2; ++k){
+            matrix p = layer_param(m.layers[i], k, 0);
+            if(p.data) n += (size_t)p.rows*p.cols;
+        }
+    }
+    return n;
+}
+
+// Copy a net's weights and biases, or their gradients, to or from x
+// int out: 1 to copy into x, 0 to copy out of it
+// int add: add x into the net instead of copying over it
+static void flat_params(net m, float *x, int grads, int out, int add)
+{
+    int i, k, r, j;
+    for(i = 0; i < m.n; ++i){
+        for(k = 0; k < 2; ++k){
+            matrix p = layer_param(m.layers[i], k, grads);
+            if(!p.data) continue;
+            for(r = 0; r < p.rows; ++r){
+                float *row = p.data + (size_t)r*p.ld;
+                if(out) memcpy(x, row, p.cols*sizeof(float));
+                else if(add) for(j = 0; j < p.cols; ++j) row[j] += x[j];
+                else memcpy(row, x, p.cols*sizeof(float));
+                x += p.cols;
+            }
+        }
+    }
+}
+
+// Write the server's net into the next weight buffer and make it current
+static void publish(param_server *s, net m)
+{
+    ps_header *h = header(s);
+    unsigned long long v = atomic_load_explicit(&h->version, memory_order_relaxed) + 1;
+    int buf = v % 2;
+    atomic_fetch_add_explicit(&h->seq[buf], 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    flat_params(m, (float *)(s->map + h->weights[buf]), 0, 1, 0);
+    atomic_fetch_add_explicit(&h->seq[buf], 1, memory_order_release);
+    atomic_store_explicit(&h->version, v, memory_order_release);
+}
+
+// Copy the latest weights into a worker's net
+// returns: version of the weights, or older if they changed while copying
+static unsigned long long pull(param_server *s, net m)
+{
+    ps_header *h = header(s);
+    int spins = 0;
+    for(;;){
+        unsigned long long v = atomic_load_explicit(&h->version, memory_order_acquire);
+        int buf = v % 2;
+        unsigned long long before = atomic_load_explicit(&h->seq[buf], memory_order_acquire);
+        if(!(before & 1)){
+            memcpy(s->flat, s->map + h->weights[buf], h->n*sizeof(float));
+            atomic_thread_fence(memory_order_acquire);
+            if(atomic_load_explicit(&h->seq[buf], memory_order_relaxed) == before){
+                flat_params(m, s->flat, 0, 0, 0);
+                return v;
+            }
+        }
+        backoff(&spins);
+    }
+}
+
+// Start serving a net's weights to worker processes
+// Any old segment with the same name is replaced.
+// char *name: name of the shared memory segment, like "/uwnet-ps"
+// net m: net to serve, it is the one that gets trained
+// int workers: most worker processes that will connect
+// int staleness: most updates a gradient's weights can be behind and still be used
+// returns: server to run with run_param_server, or 0 if it can't be made
+param_server *serve_net(char *name, net m, int workers, int staleness)
+{
+    ps_header h = {0};
+    h.n = count_params(m);
+    h.workers = workers;
+    h.staleness = staleness;
+    h.weights[0] = (sizeof(ps_header) + 63) & ~(size_t)63;
+    h.weights[1] = h.weights[0] + ((h.n*sizeof(float) + 63) & ~(size_t)63);
+    h.slots = h.weights[1] + (h.weights[1] - h.weights[0]);
+    // Sparse gradients are only sent when they fit in the dense space
+    h.slot_size = sizeof(slot_header) + (h.weights[1] - h.weights[0]);
+    h.size = h.slots + workers*h.slot_size;
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0) return 0;
+    // Reserve the pages now, running out of shared memory later is SIGBUS
+    char *map = MAP_FAILED;
+    if(!posix_fallocate(fd, 0, h.size)) map = mmap(0, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        shm_unlink(name);
+        return 0;
+    }
+
+    param_server *s = calloc(1, sizeof(param_server));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->map = map;
+    s->size = h.size;
+    s->owner = 1;
+    s->timeout = PS_WORKER_TIMEOUT;
+    s->flat = calloc(h.n, sizeof(float));
+    memcpy(map, &h, sizeof(h));
+    atomic_store(&header(s)->version, (unsigned long long)-1);
+    publish(s, m);
+    atomic_store_explicit(&header(s)->magic, PS_MAGIC, memory_order_release);
+    return s;
+}
+
+// Connect to a parameter server as a worker, waiting for it to start
+// returns: server to train against, or 0 if it never showed up
+param_server *connect_param_server(char *name)
+{
+    int tries;
+    for(tries = 0; tries < PS_CONNECT_TIMEOUT*100; ++tries){
+        struct stat st;
+        int fd = shm_open(name, O_RDWR, 0);
+        if(fd >= 0 && !fstat(fd, &st) && st.st_size >= (off_t)sizeof(ps_header)){
+            char *map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(map == MAP_FAILED) return 0;
+            ps_header *h = (ps_header *)map;
+            if(atomic_load_explicit(&h->magic, memory_order_acquire) == PS_MAGIC){
+                param_server *s = calloc(1, sizeof(param_server));
+                snprintf(s->name, sizeof(s->name), "%s", name);
+                s->map = map;
+                s->size = st.st_size;
+                s->worker = -1;
+                s->flat = calloc(h->n, sizeof(float));
+                return s;
+            }
+            munmap(map, st.st_size);
+        } else if(fd >= 0){
+            close(fd);
+        }
+        struct timespec ts = {0, 10000000};
+        nanosleep(&ts, 0);
+    }
+    return 0;
+}
+
+// Set how long the server waits for a worker to join or be heard from
+// before it counts the worker as dead
+// int seconds: timeout, PS_WORKER_TIMEOUT to start with
+void set_param_server_timeout(param_server *s, int seconds)
+{
+    s->timeout = seconds;
+}
+
+void close_param_server(param_server *s)
+{
+    if(!s) return;
+    munmap(s->map, s->size);
+    if(s->owner) shm_unlink(s->name);
+    free(s->flat);
+    free(s);
+}
+
+// Get counts of gradients applied, thrown away as too stale, and sent sparse
+void param_server_stats(param_server *s, long long *applied, long long *dropped, long long *sparse)
+{
+    ps_header *h = header(s);
+    *applied = h->applied;
+    *dropped = h->dropped;
+    *sparse = h->sparse;
+}
+
+// Apply one full slot's gradient to the server's net
+static void apply_slot(param_server *s, slot_header *slot, net m, int batch, float rate, float momentum, float decay)
+{
+    size_t i;
+    ps_header *h = header(s);
+    float *g = s->flat;
+    const char *data = (const char *)(slot + 1);
+    if(slot->sparse){
+        const int *index = (const int *)data;
+        const float *value = (const float *)(data + slot->count*sizeof(int));
+        memset(g, 0, h->n*sizeof(float));
+        for(i = 0; i < slot->count; ++i) g[index[i]] = value[i];
+        ++h->sparse;
+    } else {
+        memcpy(g, data, h->n*sizeof(float));
+    }
+    flat_params(m, g, 1, 0, 1);
+    update_net(m, rate/batch, momentum, decay);
+    publish(s, m);
+    ++h->applied;
+}
+
+// Check that some worker could still send a gradient
+// A worker is live if it joined, hasn't left and has been heard from within
+// the timeout. Until the first one joins, the timeout runs from start.
+static int workers_alive(param_server *s, long long start)
+{
+    int i;
+    ps_header *h = header(s);
+    long long now = now_ms();
+    int joined = atomic_load(&h->joined);
+    if(joined > h->workers) joined = h->workers;
+    if(!joined) return now - start < s->timeout*1000LL;
+    for(i = 0; i < joined; ++i){
+        slot_header *slot = get_slot(s, i);
+        if(atomic_load(&slot->gone)) continue;
+        if(now - atomic_load(&slot->beat) < s->timeout*1000LL) return 1;
+    }
+    return 0;
+}
+
+// Train the served net with gradients from the workers until enough have
+// been applied, then tell the workers to stop
+// Each gradient is one SGD step, with momentum kept in the net's dw/db.
+// int batch: examples in each worker's batch
+// int updates: gradients to apply
+// returns: 1 once updates gradients are applied, 0 if every worker left or
+//          went quiet first
+int run_param_server(param_server *s, net m, int batch, int updates, float rate, float momentum, float decay)
+{
+    int i;
+    ps_header *h = header(s);
+    int spins = 0;
+    long long start = now_ms();
+    while(h->applied < updates){
+        int found = 0;
+        for(i = 0; i < h->workers && h->applied < updates; ++i){
+            slot_header *slot = get_slot(s, i);
+            if(atomic_load_explicit(&slot->state, memory_order_acquire) != SLOT_FULL) continue;
+            found = 1;
+            unsigned long long v = atomic_load_explicit(&h->version, memory_order_relaxed);
+            if(v - slot->base > (unsigned long long)h->staleness) ++h->dropped;
+            else apply_slot(s, slot, m, batch, rate, momentum, decay);
+            atomic_store_explicit(&slot->state, SLOT_EMPTY, memory_order_release);
+        }
+        if(found){
+            spins = 0;
+        } else if(!workers_alive(s, start)){
+            fprintf(stderr, "Parameter server has no live workers, stopping after %lld updates\n", h->applied);
+            atomic_store(&h->done, 1);
+            return 0;
+        } else {
+            backoff(&spins);
+        }
+    }
+    atomic_store(&h->done, 1);
+    return 1;
+}
+
+// Put a gradient in this worker's slot once the server has taken the last
+// Gradients that are mostly zeros go as index, value pairs.
+// returns: 0 if the server finished while we waited
+static int push(param_server *s, unsigned long long base)
+{
+    size_t i, nonzero = 0;
+    ps_header *h = header(s);
+    slot_header *slot = get_slot(s, s->worker);
+    const float *g = s->flat;
+    int spins = 0;
+    while(atomic_load_explicit(&slot->state, memory_order_acquire) != SLOT_EMPTY){
+        if(atomic_load(&h->done)) return 0;
+        atomic_store(&slot->beat, now_ms());
+        backoff(&spins);
+    }
+    for(i = 0; i < h->n; ++i) nonzero += g[i] != 0;
+    char *data = (char *)(slot + 1);
+    slot->base = base;
+    slot->sparse = nonzero*2 < h->n;
+    if(slot->sparse){
+        int *index = (int *)data;
+        float *value = (float *)(data + nonzero*sizeof(int));
+        size_t k = 0;
+        for(i = 0; i < h->n; ++i){
+            if(g[i] == 0) continue;
+            index[k] = i;
+            value[k] = g[i];
+            ++k;
+        }
+        slot->count = nonzero;
+    } else {
+        memcpy(data, g, h->n*sizeof(float));
+        slot->count = h->n;
+    }
+    atomic_store_explicit(&slot->state, SLOT_FULL, memory_order_release);
+    return 1;
+}
+
+// Compute gradients for a parameter server until it has enough
+// Pulls the latest weights before every batch and never waits on other
+// workers, only on the server taking this worker's last gradient. Batchnorm
+// statistics stay with the worker.
+// net m: net the same shape as the served one, its weights are replaced
+// data d: data set to draw batches from
+// returns: batches this worker computed gradients for
+int train_image_classifier_worker(net m, data d, int batch, param_server *s)
+{
+    int i, e = 0;
+    ps_header *h = header(s);
+    if(count_params(m) != h->n){
+        fprintf(stderr, "Net doesn't match the parameter server's\n");
+        return 0;
+    }
+    s->worker = atomic_fetch_add(&h->joined, 1);
+    if(s->worker >= h->workers){
+        fprintf(stderr, "Parameter server already has %d workers\n", h->workers);
+        return 0;
+    }
+    slot_header *slot = get_slot(s, s->worker);
+    atomic_store(&slot->beat, now_ms());
+    loader *l = start_loader(d, batch, s->worker);
+    while(!atomic_load(&h->done)){
+        atomic_store(&slot->beat, now_ms());
+        unsigned long long base = pull(s, m);
+        for(i = 0; i < m.n; ++i){
+            if(m.layers[i].dw.data) scal_matrix(0, m.layers[i].dw);
+            if(m.layers[i].db.data) scal_matrix(0, m.layers[i].db);
+        }
+        data b = loader_next(l);
+        float err = batch_gradient(m, b);
+        fprintf(stderr, "worker %d %06d: Loss: %f\n", s->worker, e, err);
+        flat_params(m, s->flat, 1, 1, 0);
+        if(!push(s, base)) break;
+        ++e;
+    }
+    atomic_store(&slot->gone, 1);
+    stop_loader(l);
+    return e;
+}
@@ -468,6 +468,10 @@ STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 // flip the image vertically, so the first pixel in the output array is the bottom left
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 
+// let JPEGs on this thread decode at 1/2, 1/4 or 1/8 size, picking the
+// smallest scale that is still at least min_w x min_h. 0, 0 turns it off
+STBIDEF void stbi_set_jpeg_min_size(int min_w, int min_h);
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -984,6 +988,16 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
+#ifndef STBI_THREAD_LOCAL
+#if defined(__GNUC__)
+#define STBI_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define STBI_THREAD_LOCAL __declspec(thread)
+#else
+#define STBI_THREAD_LOCAL
+#endif
+#endif
+
 static int stbi__vertically_flip_on_load = 0;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
@@ -1767,6 +1781,10 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+   // reduced size decoding: blocks are 8>>scale_shift samples on a side
+   int scale_shift;
+   float scaled_idct[4][4];
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
@@ -2705,6 +2723,64 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+static STBI_THREAD_LOCAL int stbi__jpeg_min_w = 0;
+static STBI_THREAD_LOCAL int stbi__jpeg_min_h = 0;
+
+STBIDEF void stbi_set_jpeg_min_size(int min_w, int min_h)
+{
+   stbi__jpeg_min_w = min_w;
+   stbi__jpeg_min_h = min_h;
+}
+
+// Pick how far to scale down in the DCT and build the reduced IDCT table.
+// Sampling the 8-point basis at the centres of n output pixels gives an
+// n x n block from the lowest n x n coefficients.
+static void stbi__jpeg_pick_scale(stbi__jpeg *z)
+{
+   int x,u,n;
+   stbi__context *s = z->s;
+   z->scale_shift = 0;
+   if (stbi__jpeg_min_w <= 0 && stbi__jpeg_min_h <= 0) return;
+   while (z->scale_shift < 3
+          && (int)((s->img_x + (2u << z->scale_shift) - 1) >> (z->scale_shift+1)) >= stbi__jpeg_min_w
+          && (int)((s->img_y + (2u << z->scale_shift) - 1) >> (z->scale_shift+1)) >= stbi__jpeg_min_h)
+      ++z->scale_shift;
+   n = 8 >> z->scale_shift;
+   for (x=0; x < n && n < 8; ++x)
+      for (u=0; u < n; ++u)
+         z->scaled_idct[x][u] = (u ? 0.5f : 0.35355339f) * (float) cos((2*x+1)*u*3.14159265358979 / (2*n));
+}
+
+static void stbi__idct_scaled(stbi__jpeg *z, stbi_uc *out, int out_stride, short data[64])
+{
+   int n = 8 >> z->scale_shift;
+   int x,y,u,v;
+   float tmp[4][4];
+   for (v=0; v < n; ++v)
+      for (x=0; x < n; ++x) {
+         float sum = 0;
+         for (u=0; u < n; ++u) sum += data[v*8+u] * z->scaled_idct[x][u];
+         tmp[v][x] = sum;
+      }
+   for (y=0; y < n; ++y, out += out_stride)
+      for (x=0; x < n; ++x) {
+         float sum = 128.5f;
+         for (v=0; v < n; ++v) sum += z->scaled_idct[y][v] * tmp[v][x];
+         out[x] = sum <= 0 ? 0 : sum >= 255 ? 255 : (stbi_uc) sum;
+      }
+}
+
+// inverse transform block (bx,by) of component n into its place in data
+static void stbi__jpeg_idct(stbi__jpeg *z, int n, int bx, int by, short data[64])
+{
+   int size = 8 >> z->scale_shift;
+   stbi_uc *out = z->img_comp[n].data + z->img_comp[n].w2*by*size + bx*size;
+   if (z->scale_shift)
+      stbi__idct_scaled(z, out, z->img_comp[n].w2, data);
+   else
+      z->idct_block_kernel(out, z->img_comp[n].w2, data);
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
@@ -2723,7 +2799,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct(z, n, i, j, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2747,11 +2823,11 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x);
+                        int y2 = (j*z->img_comp[n].v + y);
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        stbi__jpeg_idct(z, n, x2, y2, data);
                      }
                   }
                }
@@ -2848,7 +2924,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               stbi__jpeg_idct(z, n, i, j, data);
             }
          }
       }
@@ -3053,6 +3129,8 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 
    if (!stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) return stbi__err("too large", "Image too large to decode");
 
+   stbi__jpeg_pick_scale(z);
+
    for (i=0; i < s->img_n; ++i) {
       if (z->img_comp[i].h > h_max) h_max = z->img_comp[i].h;
       if (z->img_comp[i].v > v_max) v_max = z->img_comp[i].v;
@@ -3078,8 +3156,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // when decoding at reduced size each block only makes 8>>scale_shift
+      // samples on a side
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->scale_shift);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->scale_shift);
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3089,10 +3169,10 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         // every block keeps all 64 coefficients whatever the output scale
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3550,6 +3630,7 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
+   j->scale_shift = 0;
    j->idct_block_kernel = stbi__idct_block;
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
@@ -3603,6 +3684,15 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // reduced size decoding: everything from here on works on the smaller image
+   if (z->scale_shift) {
+      int k, round = (1 << z->scale_shift) - 1;
+      z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+      for (k=0; k < z->s->img_n; ++k)
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale_shift;
+   }
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "uwnet.h"
+#include "pool.h"
+#include "pack.h"
+
+// Examples read from disk per pread
+#define STREAM_CHUNK 256
+
+// Streams examples from packed shards on disk through a bounded shuffle
+// buffer. A reader thread walks the shards in a random order each epoch,
+// reading each one front to back, and drops examples into free slots of
+// the buffer. Batches take random full slots and give them back, so memory
+// stays at the buffer size however big the data set is.
+struct stream{
+    lines shards;
+    pack_header shape;
+    long long examples;
+
+    // Slots of the shuffle buffer: d.bytes and d.labels hold one example
+    // per slot and describe how to turn them into floats
+    data d;
+    int size;
+    int *free_slots;
+    int nfree;
+    int *full;
+    int nfull;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int stop;
+    int failed;
+    int epoch;
+    unsigned long long state;
+    unsigned long long reader_state;
+    pthread_t thread;
+};
+
+// From data.c
+void example_to_floats(data d, int i, float *dst);
+
+static int read_header(char *filename, pack_header *h)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return 0;
+    int ok = pread(fd, h, sizeof(*h), 0) == sizeof(*h) && !memcmp(h->magic, PACK_MAGIC, sizeof(h->magic));
+    close(fd);
+    return ok;
+}
+
+static int read_fully(int fd, void *buf, size_t size, off_t offset)
+{
+    char *p = buf;
+    while(size){
+        ssize_t r = pread(fd, p, size, offset);
+        if(r <= 0) return 0;
+        p += r;
+        offset += r;
+        size -= r;
+    }
+    return 1;
+}
+
+// Ask the kernel to start reading a shard before we get to it
+static void prefetch_shard(char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+// Copy count examples into free slots, waiting for room as needed
+// int count: at most STREAM_CHUNK
+// returns: 0 if the stream was stopped
+static int insert_examples(stream *s, unsigned char *pixels, int *labels, int count)
+{
+    int cols = s->d.x.cols;
+    int slots[STREAM_CHUNK];
+    while(count){
+        pthread_mutex_lock(&s->lock);
+        while(!s->nfree && !s->stop) pthread_cond_wait(&s->changed, &s->lock);
+        if(s->stop){
+            pthread_mutex_unlock(&s->lock);
+            return 0;
+        }
+        // Take every free slot we can use in one go, fill them unlocked
+        int i;
+        int take = s->nfree < count ? s->nfree : count;
+        for(i = 0; i < take; ++i) slots[i] = s->free_slots[--s->nfree];
+        pthread_mutex_unlock(&s->lock);
+
+        for(i = 0; i < take; ++i){
+            memcpy(s->d.bytes + (size_t)slots[i]*cols, pixels + (size_t)i*cols, cols);
+            s->d.labels[slots[i]] = labels[i];
+        }
+
+        pthread_mutex_lock(&s->lock);
+        for(i = 0; i < take; ++i) s->full[s->nfull++] = slots[i];
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+        pixels += (size_t)take*cols;
+        labels += take;
+        count -= take;
+    }
+    return 1;
+}
+
+// Read one shard front to back into the shuffle buffer
+// returns: examples read, -1 if the stream was stopped
+static int read_shard(stream *s, char *filename, unsigned char *chunk)
+{
+    pack_header h;
+    int fd = open(filename, O_RDONLY);
+    int ok = 1;
+    int got = 0;
+    if(fd < 0 || !read_fully(fd, &h, sizeof(h), 0) || memcmp(h.magic, PACK_MAGIC, sizeof(h.magic))
+            || h.w != s->shape.w || h.h != s->shape.h || h.c != s->shape.c || h.k != s->shape.k){
+        fprintf(stderr, "Skipping bad shard %s\n", filename);
+        if(fd >= 0) close(fd);
+        return 0;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    size_t cols = s->d.x.cols;
+    int *labels = calloc(h.n, sizeof(int));
+    if(!read_fully(fd, labels, h.n*sizeof(int), h.labels)) ok = -1;
+    int i;
+    for(i = 0; ok > 0 && i < h.n; i += STREAM_CHUNK){
+        int count = (h.n - i < STREAM_CHUNK) ? h.n - i : STREAM_CHUNK;
+        off_t offset = h.pixels + (off_t)i*cols;
+        if(!read_fully(fd, chunk, count*cols, offset)){
+            ok = -1;
+            break;
+        }
+        // We won't read it again this epoch, don't let it crowd the page cache
+        posix_fadvise(fd, offset, count*cols, POSIX_FADV_DONTNEED);
+        ok = insert_examples(s, chunk, labels + i, count);
+        if(ok) got += count;
+    }
+    if(ok < 0) fprintf(stderr, "Couldn't read shard %s\n", filename);
+    free(labels);
+    close(fd);
+    return ok ? got : -1;
+}
+
+static void *reader_thread(void *ptr)
+{
+    stream *s = ptr;
+    int n = s->shards.n;
+    int *order = calloc(n, sizeof(int));
+    unsigned char *chunk = pool_calloc((size_t)STREAM_CHUNK*s->d.x.cols, 1);
+    int i;
+    for(i = 0; i < n; ++i) order[i] = i;
+    for(;;){
+        long long got = 0;
+        for(i = n-1; i > 0; --i){
+            int j = rand_range(&s->reader_state, i+1);
+            int t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+        for(i = 0; i < n; ++i){
+            if(i + 1 < n) prefetch_shard(s->shards.line[order[i+1]]);
+            int r = read_shard(s, s->shards.line[order[i]], chunk);
+            if(r < 0) goto done;
+            got += r;
+        }
+        pthread_mutex_lock(&s->lock);
+        ++s->epoch;
+        // Another epoch won't go any better, let waiting batches give up
+        if(!got) s->failed = 1;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+        if(!got){
+            fprintf(stderr, "No shard could be read, stopping stream\n");
+            break;
+        }
+    }
+done:
+    pool_free(chunk);
+    free(order);
+    return 0;
+}
+
+// Open a streaming data set
+// char *shard_list: file listing one packed shard per line, as written
+//                   by pack_image_classification_shards
+// int buffer: examples in the shuffle buffer, more shuffles better
+// unsigned long long seed: seed for the shard order and the shuffle
+// returns: stream, or 0 if the shards couldn't be read
+stream *open_stream(char *shard_list, int buffer, unsigned long long seed)
+{
+    int i;
+    lines shards = read_lines(shard_list);
+    pack_header h;
+    long long examples = 0;
+    for(i = 0; i < shards.n; ++i){
+        pack_header hi;
+        if(!read_header(shards.line[i], &hi) || (i && (hi.w != h.w || hi.h != h.h || hi.c != h.c || hi.k != h.k))){
+            fprintf(stderr, "Bad shard %s\n", shards.line[i]);
+            free_lines(shards);
+            return 0;
+        }
+        if(!i) h = hi;
+        examples += hi.n;
+    }
+    if(!examples){
+        free_lines(shards);
+        return 0;
+    }
+
+    stream *s = calloc(1, sizeof(stream));
+    s->shards = shards;
+    s->shape = h;
+    s->examples = examples;
+    s->size = buffer;
+    s->d.x = float_to_matrix(0, buffer, h.w*h.h*h.c);
+    s->d.y = float_to_matrix(0, buffer, h.k);
+    s->d.bytes = pool_calloc((size_t)buffer*s->d.x.cols, 1);
+    s->d.labels = pool_calloc(buffer, sizeof(int));
+    s->free_slots = calloc(buffer, sizeof(int));
+    s->full = calloc(buffer, sizeof(int));
+    for(i = 0; i < buffer; ++i) s->free_slots[i] = i;
+    s->nfree = buffer;
+    s->state = seed;
+    s->reader_state = seed ^ 0x9e3779b97f4a7c15ULL;
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->changed, 0);
+    if(pthread_create(&s->thread, 0, reader_thread, s)){
+        fprintf(stderr, "Couldn't start stream reader thread\n");
+        exit(-1);
+    }
+    return s;
+}
+
+// Normalize a stream per channel as batches are made, like normalize_data
+void normalize_stream(stream *s, int channels, float *mean, float *std)
+{
+    normalize_data(&s->d, channels, mean, std);
+}
+
+// Describe the examples in a stream
+// returns: data with no examples whose x and y columns and label kind
+//          match the stream, for make_batch
+data stream_format(stream *s)
+{
+    data d = s->d;
+    d.x.rows = d.y.rows = 0;
+    d.shallow = 1;
+    return d;
+}
+
+// Fill a batch with random examples from the shuffle buffer
+// Waits until the buffer is at least half full so early batches are
+// shuffled too.
+// data b: batch from make_batch(stream_format(s), n)
+// returns: 1 on success, 0 if the stream was closed or none of its shards
+//          can be read any more
+int stream_batch(stream *s, data b)
+{
+    int i;
+    int n = b.x.rows;
+    int need = s->size/2 > n ? s->size/2 : n;
+    int *taken = calloc(n, sizeof(int));
+    if(n > s->size){
+        fprintf(stderr, "Batch of %d is bigger than the stream buffer of %d\n", n, s->size);
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while(s->nfull < need && !s->stop && !s->failed) pthread_cond_wait(&s->changed, &s->lock);
+    if(s->nfull < need){
+        pthread_mutex_unlock(&s->lock);
+        free(taken);
+        return 0;
+    }
+    for(i = 0; i < n; ++i){
+        int j = rand_range(&s->state, s->nfull);
+        taken[i] = s->full[j];
+        s->full[j] = s->full[--s->nfull];
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    for(i = 0; i < n; ++i){
+        example_to_floats(s->d, taken[i], b.x.data + (size_t)i*b.x.ld);
+        b.labels[i] = s->d.labels[taken[i]];
+    }
+
+    pthread_mutex_lock(&s->lock);
+    for(i = 0; i < n; ++i) s->free_slots[s->nfree++] = taken[i];
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    free(taken);
+    return 1;
+}
+
+// Total examples across all the shards
+long long stream_examples(stream *s)
+{
+    return s->examples;
+}
+
+// Number of times the reader has been through every shard
+int stream_epoch(stream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    int epoch = s->epoch;
+    pthread_mutex_unlock(&s->lock);
+    return epoch;
+}
+
+void close_stream(stream *s)
+{
+    if(!s) return;
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, 0);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->changed);
+    pool_free(s->d.bytes);
+    pool_free(s->d.labels);
+    free(s->free_slots);
+    free(s->full);
+    free_lines(s->shards);
+    free(s);
+}
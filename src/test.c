@@ -4,11 +4,23 @@
 #include <assert.h>
 #include <time.h>
 #include <sys/time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "uwnet.h"
 #include "matrix.h"
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "pool.h"
+#include "matcher.h"
+#include "fileio.h"
+#include "parallel.h"
+#include "pack.h"
 // Forward declare for tests
 matrix mean(matrix x, int groups);
 matrix variance(matrix x, matrix m, int groups);
@@ -16,6 +28,11 @@ matrix normalize(matrix x, matrix m, matrix v, int groups);
 matrix delta_mean(matrix d, matrix v);
 matrix delta_variance(matrix d, matrix x, matrix m, matrix v);
 matrix delta_batch_norm(matrix d, matrix dm, matrix dv, matrix m, matrix v, matrix x);
+float cross_entropy_loss(matrix x, matrix y);
+matrix cross_entropy_derivative(matrix x, matrix y);
+float cross_entropy_loss_sparse(matrix x, int *labels);
+matrix cross_entropy_derivative_sparse(matrix x, int *labels);
+void stbi_set_jpeg_min_size(int min_w, int min_h);
 
 int tests_total = 0;
 int tests_fail = 0;
@@ -27,15 +44,17 @@ int within_eps(float a, float b){
 
 int same_matrix(matrix a, matrix b)
 {
-    int i;
+    int i, j;
     if(a.rows != b.rows || a.cols != b.cols) {
         printf ("first matrix: %dx%d, second matrix:%dx%d\n", a.rows, a.cols, b.rows, b.cols);
         return 0;
     }
-    for(i = 0; i < a.rows*a.cols; ++i){
-        if(!within_eps(a.data[i], b.data[i])) {
-            printf("differs at %d, %f vs %f\n", i, a.data[i], b.data[i]);
-            return 0;
+    for(i = 0; i < a.rows; ++i){
+        for(j = 0; j < a.cols; ++j){
+            if(!within_eps(a.data[i*a.ld + j], b.data[i*b.ld + j])) {
+                printf("differs at %d, %f vs %f\n", i*a.cols + j, a.data[i*a.ld + j], b.data[i*b.ld + j]);
+                return 0;
+            }
         }
     }
     return 1;
@@ -59,6 +78,50 @@ void test_copy_matrix()
     free_matrix(c);
 }
 
+void test_pool()
+{
+    size_t live = pool_live_bytes();
+    matrix a = random_matrix(32, 64, 10);
+    TEST(((size_t)a.data & 63) == 0);
+    TEST(pool_live_bytes() == live + 32*64*sizeof(float));
+    float *p = a.data;
+    free_matrix(a);
+    TEST(pool_live_bytes() == live);
+    matrix b = make_matrix(64, 32);
+    int i, zero = 1;
+    for(i = 0; i < b.rows*b.ld; ++i) zero = zero && b.data[i] == 0;
+    TEST(b.data == p && zero);
+    image im = make_image(1024, 1024, 3);
+    TEST(((size_t)im.data & 63) == 0 && im.data[1024*1024*3-1] == 0);
+    TEST(pool_peak_bytes() >= live + 1024*1024*3*sizeof(float));
+    free_image(im);
+    free_matrix(b);
+}
+
+void test_matrix_views()
+{
+    matrix a = random_matrix(40, 512, 10);
+    TEST(a.ld > a.cols && (a.ld % 16) == 0);
+    matrix r = view_rows(a, 8, 16);
+    matrix c = view_cols(r, 100, 32);
+    TEST(r.rows == 16 && c.rows == 16 && c.cols == 32 && c.ld == a.ld);
+    TEST(c.data[3*c.ld + 5] == a.data[11*a.ld + 105]);
+    matrix cc = copy_matrix(c);
+    TEST(same_matrix(c, cc));
+    matrix ct = transpose_matrix(c);
+    matrix ctt = transpose_matrix(ct);
+    TEST(same_matrix(c, ctt));
+    scal_matrix(0, c);
+    TEST(a.data[11*a.ld + 105] == 0 && a.data[11*a.ld + 99] != 0);
+    size_t live = pool_live_bytes();
+    free_matrix(c);
+    TEST(pool_live_bytes() == live);
+    free_matrix(cc);
+    free_matrix(ct);
+    free_matrix(ctt);
+    free_matrix(a);
+}
+
 void test_transpose_matrix()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -97,6 +160,756 @@ void test_matmul()
     free_matrix(mul);
 }
 
+void test_sampler()
+{
+    int n = 100;
+    int i;
+    int *seen = calloc(n, sizeof(int));
+    int ind[10];
+    sampler s = make_sampler(n, 7);
+    for(i = 0; i < n/10; ++i){
+        sample_indexes(&s, ind, 10);
+        int j;
+        for(j = 0; j < 10; ++j) ++seen[ind[j]];
+    }
+    int once = 1;
+    for(i = 0; i < n; ++i) once = once && seen[i] == 1;
+    TEST(once && s.epoch == 0);
+    sample_indexes(&s, ind, 10);
+    TEST(s.epoch == 1);
+
+    data d = make_data(n, 3, 2);
+    for(i = 0; i < n; ++i){
+        d.x.data[i*d.x.ld + 2] = i;
+        d.y.data[i*d.y.ld + 1] = -i;
+    }
+    data b = make_data(10, 3, 2);
+    gather_batch(d, ind, b);
+    int same = 1;
+    for(i = 0; i < 10; ++i){
+        same = same && b.x.data[i*b.x.ld + 2] == ind[i] && b.y.data[i*b.y.ld + 1] == -ind[i];
+    }
+    TEST(same);
+
+    // The loader hands out the same batches a sorted sampler would
+    loader *l = start_loader(d, 10, 3);
+    sampler s2 = make_sampler(n, 3);
+    s2.sorted = 1;
+    same = 1;
+    int k;
+    for(k = 0; k < 25; ++k){
+        data lb = loader_next(l);
+        sample_indexes(&s2, ind, 10);
+        for(i = 0; i < 10; ++i) same = same && lb.x.data[i*lb.x.ld + 2] == ind[i];
+    }
+    TEST(same);
+    stop_loader(l);
+    free_sampler(s2);
+
+    free_data(b);
+    free_data(d);
+    free_sampler(s);
+    free(seen);
+}
+
+void write_lines(char *filename, char **lines, int n)
+{
+    FILE *fp = fopen(filename, "w");
+    int i;
+    for(i = 0; i < n; ++i) fprintf(fp, "%s\n", lines[i]);
+    fclose(fp);
+}
+
+// Check read_lines splits a file the same way fgetl does
+int same_lines(char *contents, size_t size)
+{
+    FILE *fp = fopen("/tmp/uwnet_test.lines", "w");
+    fwrite(contents, 1, size, fp);
+    fclose(fp);
+    lines l = read_lines("/tmp/uwnet_test.lines");
+    fp = fopen("/tmp/uwnet_test.lines", "r");
+    int same = 1;
+    int i = 0;
+    char *line;
+    while((line = fgetl(fp))){
+        if(i >= l.n || strcmp(line, l.line[i])) same = 0;
+        free(line);
+        ++i;
+    }
+    fclose(fp);
+    if(i != l.n) same = 0;
+    free_lines(l);
+    return same;
+}
+
+void test_read_lines()
+{
+    TEST(same_lines("a\nbb\n\nccc\n", 10));
+    TEST(same_lines("a\nbb\nno newline", 16));
+    TEST(same_lines("", 0));
+    TEST(same_lines("\n\n", 2));
+
+    // A file that fills whole pages with no newline at the end
+    int size = sysconf(_SC_PAGESIZE);
+    char *page = calloc(size, 1);
+    memset(page, 'x', size);
+    page[100] = '\n';
+    TEST(same_lines(page, size));
+    free(page);
+}
+
+typedef struct {
+    unsigned char *expected[4];
+    size_t sizes[4];
+    int ok;
+} read_check;
+
+static void check_file(int i, unsigned char *buf, size_t size, void *ptr)
+{
+    read_check *c = ptr;
+    if(!c->expected[i]){
+        if(buf) c->ok = 0;
+    } else if(!buf || size != c->sizes[i] || memcmp(buf, c->expected[i], size)){
+        c->ok = 0;
+    }
+    free(buf);
+}
+
+// process_files over many copies of the read_files paths
+typedef struct {
+    read_check *c;
+    int *seen;
+} process_check;
+
+static void check_processed(int i, unsigned char *buf, size_t size, void *ptr)
+{
+    process_check *p = ptr;
+    read_check *c = p->c;
+    int f = i % 4;
+    __atomic_fetch_add(p->seen + i, 1, __ATOMIC_RELAXED);
+    if(!c->expected[f]){
+        if(buf) c->ok = 0;
+    } else if(!buf || size != c->sizes[f] || memcmp(buf, c->expected[f], size)){
+        c->ok = 0;
+    }
+}
+
+void test_read_files()
+{
+    char *paths[] = {"/tmp/uwnet_read0", "/tmp/uwnet_read1", "/tmp/uwnet_missing", "/tmp/uwnet_read3"};
+    size_t sizes[] = {0, 1000, 0, 300000};
+    read_check c = {{0}};
+    int i, j, pass;
+    for(i = 0; i < 4; ++i){
+        if(i == 2) continue;
+        c.sizes[i] = sizes[i];
+        c.expected[i] = malloc(sizes[i] + 1);
+        for(j = 0; j < sizes[i]; ++j) c.expected[i][j] = (j*31 + i) & 255;
+        FILE *fp = fopen(paths[i], "wb");
+        fwrite(c.expected[i], 1, sizes[i], fp);
+        fclose(fp);
+    }
+    unlink(paths[2]);
+    // Once through io_uring if we have it, once through the thread pool
+    for(pass = 0; pass < 2; ++pass){
+        if(pass) setenv("UWNET_NO_URING", "1", 1);
+        c.ok = 1;
+        int failed = read_files(paths, 4, check_file, &c);
+        TEST(failed == 1 && c.ok);
+
+        // Enough files that later chunks are read while earlier ones are processed
+        int n = 2500;
+        char **many = calloc(n, sizeof(char *));
+        process_check p = {&c, calloc(n, sizeof(int))};
+        for(i = 0; i < n; ++i) many[i] = paths[i % 4];
+        process_files(many, n, check_processed, &p);
+        int once = 1;
+        for(i = 0; i < n; ++i) once &= p.seen[i] == 1;
+        TEST(once && c.ok);
+        free(p.seen);
+        free(many);
+    }
+    unsetenv("UWNET_NO_URING");
+    for(i = 0; i < 4; ++i){
+        free(c.expected[i]);
+        unlink(paths[i]);
+    }
+}
+
+void test_load_data()
+{
+    char *paths[] = {"data/test/dog.jpg", "data/dog.jpg", "data/test/dog.jpg"};
+    char *labels[] = {"cat", "test", "dog"};
+    unlink("/tmp/uwnet_test.list.pack");
+    write_lines("/tmp/uwnet_test.list", paths, 3);
+    write_lines("/tmp/uwnet_test.labels", labels, 3);
+    data d = load_image_classification_data("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels");
+    image im = load_image("data/test/dog.jpg");
+    matrix row = float_to_matrix(im.data, 1, im.w*im.h*im.c);
+    TEST(d.x.rows == 3 && d.x.cols == row.cols && d.y.cols == 3);
+    TEST(same_matrix(row, view_rows(d.x, 2, 1)));
+    TEST(d.y.data[0] == 0 && d.y.data[1] == 1 && d.y.data[2] == 1);
+    TEST(d.y.data[d.y.ld] == 0 && d.y.data[d.y.ld + 1] == 0 && d.y.data[d.y.ld + 2] == 1);
+    free_image(im);
+
+    // "test" and "dog" both match the first path, one int label can't hold that
+    TEST(!pack_image_classification_data("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels", "/tmp/uwnet_test.list.pack"));
+    labels[1] = "bird";
+    labels[2] = "test";
+    write_lines("/tmp/uwnet_test.labels", labels, 3);
+    data d2 = load_image_classification_data("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels");
+    TEST(pack_image_classification_data("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels", "/tmp/uwnet_test.list.pack"));
+    data p = {0};
+    TEST(load_packed_data("/tmp/uwnet_test.list.pack", "/tmp/uwnet_test.list", "/tmp/uwnet_test.labels", &p));
+    TEST(same_matrix(d2.x, p.x) && same_matrix(d2.y, p.y));
+    free_data(p);
+
+    // 8-bit data, mapped from the pack and decoded, converts back to the same floats
+    int ind[] = {2, 0, 1};
+    data bytes = load_image_classification_bytes("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels");
+    TEST(bytes.bytes && bytes.map && !bytes.x.data);
+    TEST(bytes.labels && bytes.labels[0] == 2 && bytes.labels[1] == -1 && bytes.labels[2] == 2);
+    data b = make_batch(bytes, 3);
+    gather_batch(bytes, ind, b);
+    TEST(same_matrix(view_rows(b.x, 1, 1), view_rows(d2.x, 0, 1)) && b.labels[0] == 2 && b.labels[2] == -1);
+    float mean[] = {.5, .4, .3};
+    float std[] = {.2, .25, .3};
+    normalize_data(&bytes, 3, mean, std);
+    gather_batch(bytes, ind, b);
+    int spatial = d2.x.cols/3;
+    TEST(within_eps(b.x.data[2*spatial + 7], (d2.x.data[2*d2.x.ld + 2*spatial + 7] - .3)/.3));
+    free_data(bytes);
+    unlink("/tmp/uwnet_test.list.pack");
+    bytes = load_image_classification_bytes("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels");
+    TEST(bytes.bytes && !bytes.map && bytes.labels[2] == 2);
+    gather_batch(bytes, ind, b);
+    TEST(same_matrix(view_rows(b.x, 2, 1), view_rows(d2.x, 1, 1)));
+    free_data(bytes);
+    free_data(b);
+    TEST(pack_image_classification_data("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels", "/tmp/uwnet_test.list.pack"));
+    // Changing the list makes the pack stale
+    write_lines("/tmp/uwnet_test.list", paths, 2);
+    TEST(!load_packed_data("/tmp/uwnet_test.list.pack", "/tmp/uwnet_test.list", "/tmp/uwnet_test.labels", &p));
+    p = load_image_classification_data("/tmp/uwnet_test.list", "/tmp/uwnet_test.labels");
+    TEST(p.x.rows == 2);
+    unlink("/tmp/uwnet_test.list.pack");
+
+    free_data(p);
+    free_data(d2);
+    free_data(d);
+}
+
+// Write n random 9x7 images, image i has label i%3, and list them in
+// <prefix>.list and <prefix>.labels
+void write_test_images(char *prefix, int n)
+{
+    char *paths[16];
+    char names[16][256];
+    char *labels[] = {"class0", "class1", "class2"};
+    char file[256];
+    int i;
+    assert(n <= 16);
+    for(i = 0; i < n; ++i){
+        image im = make_random_image(9, 7, 3, 1);
+        sprintf(names[i], "%s_class%d_%d", prefix, i%3, i);
+        save_image_options(im, names[i], PNG, 0);
+        strcat(names[i], ".png");
+        paths[i] = names[i];
+        free_image(im);
+    }
+    sprintf(file, "%s.list", prefix);
+    write_lines(file, paths, n);
+    sprintf(file, "%s.labels", prefix);
+    write_lines(file, labels, 3);
+}
+
+void test_stream()
+{
+    int i, j;
+    write_test_images("/tmp/uwnet_stream", 7);
+    TEST(pack_image_classification_shards("/tmp/uwnet_stream.list", "/tmp/uwnet_stream.labels", "/tmp/uwnet_stream", 3));
+    lines shards = read_lines("/tmp/uwnet_stream.shards");
+    TEST(shards.n == 3);
+    free_lines(shards);
+
+    data d = load_image_classification_data("/tmp/uwnet_stream.list", "/tmp/uwnet_stream.labels");
+    stream *s = open_stream("/tmp/uwnet_stream.shards", 4, 1);
+    TEST(s && stream_examples(s) == 7);
+    data b = make_batch(stream_format(s), 2);
+    int seen[7] = {0};
+    int ok = 1;
+    for(i = 0; i < 30; ++i){
+        stream_batch(s, b);
+        for(j = 0; j < 2; ++j){
+            // Find which example this is, its label has to come with it
+            int k, found = -1;
+            for(k = 0; k < 7; ++k){
+                if(same_matrix(view_rows(b.x, j, 1), view_rows(d.x, k, 1))) found = k;
+            }
+            if(found < 0 || b.labels[j] != found%3) ok = 0;
+            else seen[found] = 1;
+        }
+    }
+    for(i = 0; i < 7; ++i) ok &= seen[i];
+    TEST(ok && stream_epoch(s) > 0);
+    close_stream(s);
+
+    // Shards that lose everything past their header can't feed a batch
+    for(i = 0; i < 3; ++i){
+        char name[64];
+        sprintf(name, "/tmp/uwnet_stream.%05d.pack", i);
+        TEST(!truncate(name, sizeof(pack_header)));
+    }
+    s = open_stream("/tmp/uwnet_stream.shards", 4, 1);
+    TEST(s && !stream_batch(s, b));
+    close_stream(s);
+    free_data(b);
+    free_data(d);
+    for(i = 0; i < 3; ++i){
+        char name[64];
+        sprintf(name, "/tmp/uwnet_stream.%05d.pack", i);
+        unlink(name);
+    }
+}
+
+void test_lazy_data()
+{
+    int i;
+    write_test_images("/tmp/uwnet_lazy", 7);
+    data d = load_image_classification_data("/tmp/uwnet_lazy.list", "/tmp/uwnet_lazy.labels");
+    size_t row = d.x.cols*sizeof(float);
+    data lazy = load_image_classification_lazy("/tmp/uwnet_lazy.list", "/tmp/uwnet_lazy.labels", 0, 0, 3*row);
+    TEST(!has_float_examples(lazy) && lazy.x.rows == 7 && lazy.x.cols == d.x.cols && lazy.labels);
+
+    int all[] = {0, 1, 2, 3, 4, 5, 6};
+    data b = make_batch(lazy, 7);
+    gather_batch(lazy, all, b);
+    int ok = same_matrix(b.x, d.x);
+    for(i = 0; i < 7; ++i) ok &= b.labels[i] == i%3 && d.y.data[i*d.y.ld + i%3] == 1;
+    TEST(ok);
+
+    // Room for 3 rows: the last 3 used are hits, older ones were dropped
+    long long hits, misses;
+    data small = view_data(b, 0, 3);
+    int recent[] = {4, 5, 6};
+    gather_batch(lazy, recent, small);
+    cache_stats(lazy.cache, &hits, &misses);
+    TEST(hits == 3 && misses == 7);
+    gather_batch(lazy, all, small);
+    cache_stats(lazy.cache, &hits, &misses);
+    TEST(hits == 3 && misses == 10);
+    TEST(same_matrix(small.x, view_rows(d.x, 0, 3)));
+
+    // Views keep their place in the cache
+    data v = view_data(lazy, 2, 3);
+    gather_batch(v, all, small);
+    TEST(same_matrix(small.x, view_rows(d.x, 2, 3)) && small.labels[0] == 2);
+    free_data(b);
+
+    // Every image gets resized on the way in
+    data resized = load_image_classification_lazy("/tmp/uwnet_lazy.list", "/tmp/uwnet_lazy.labels", 5, 4, 0);
+    b = make_batch(resized, 1);
+    int third[] = {3};
+    gather_batch(resized, third, b);
+    image im = float_to_image(d.x.data + 3*d.x.ld, 9, 7, 3);
+    image r = bilinear_resize(im, 5, 4);
+    TEST(b.x.cols == 5*4*3 && same_matrix(b.x, float_to_matrix(r.data, 1, 5*4*3)));
+    free_image(r);
+    free_data(b);
+    free_data(resized);
+    free_data(lazy);
+
+    // Compressed files in memory decode to the same rows without the disk
+    data compressed = load_image_classification_compressed("/tmp/uwnet_lazy.list", "/tmp/uwnet_lazy.labels");
+    unlink("/tmp/uwnet_lazy_class1_4.png");
+    b = make_batch(compressed, 7);
+    gather_batch(compressed, all, b);
+    TEST(same_matrix(b.x, d.x) && b.labels[4] == 1);
+    free_data(b);
+    free_data(compressed);
+    free_data(d);
+}
+
+void test_shared_data()
+{
+    int i;
+    write_test_images("/tmp/uwnet_shared", 7);
+    char *list = "/tmp/uwnet_shared.list";
+    char *labels = "/tmp/uwnet_shared.labels";
+    unshare_image_classification_data(list, labels);
+    data d = load_image_classification_bytes(list, labels);
+    data a = load_image_classification_shared(list, labels);
+    data b = load_image_classification_shared(list, labels);
+    int ok = a.map && b.map && a.map != b.map && a.x.rows == 7 && b.x.cols == d.x.cols;
+    for(i = 0; ok && i < 7; ++i) ok &= b.labels[i] == d.labels[i];
+    TEST(ok && !memcmp(a.bytes, d.bytes, (size_t)7*d.x.cols) && !memcmp(b.bytes, d.bytes, (size_t)7*d.x.cols));
+    free_data(b);
+
+    // A label file changed since publishing makes the segment stale: the
+    // next load replaces it and the old mapping stays readable
+    struct timespec times[2] = {{0, UTIME_OMIT}, {time(0) + 10, 0}};
+    utimensat(AT_FDCWD, labels, times, 0);
+    b = load_image_classification_shared(list, labels);
+    TEST(b.map && ((pack_header *)b.map)->labels_mtime != ((pack_header *)a.map)->labels_mtime);
+    TEST(!memcmp(a.bytes, b.bytes, (size_t)7*d.x.cols));
+    free_data(a);
+    free_data(b);
+
+    // Removing it leaves nothing behind, the next load publishes again
+    TEST(unshare_image_classification_data(list, labels));
+    TEST(!unshare_image_classification_data(list, labels));
+    free_data(d);
+}
+
+void test_sparse_labels()
+{
+    int labels[] = {3, 0, 7, 15, 2, 9, 1, 4};
+    int n = 8;
+    int i;
+    layer soft = make_activation_layer(SOFTMAX);
+    matrix a = random_matrix(n, 16, 3);
+    matrix p = soft.forward(soft, a);
+    matrix y = make_matrix(n, 16);
+    for(i = 0; i < n; ++i) y.data[i*y.ld + labels[i]] = 1;
+    TEST(within_eps(cross_entropy_loss(p, y), cross_entropy_loss_sparse(p, labels)));
+    matrix d = cross_entropy_derivative(p, y);
+    matrix ds = cross_entropy_derivative_sparse(p, labels);
+    TEST(same_matrix(d, ds));
+    free_matrix(a);
+    free_matrix(p);
+    free_matrix(y);
+    free_matrix(d);
+    free_matrix(ds);
+    free_layer(soft);
+}
+
+// Reference resize, one bilinear_interpolate per output pixel
+image slow_bilinear_resize(image im, int w, int h)
+{
+    image r = make_image(w, h, im.c);
+    int i, j, k;
+    for(k = 0; k < im.c; ++k){
+        for(j = 0; j < h; ++j){
+            for(i = 0; i < w; ++i){
+                float y = (j+.5)*im.h/h - .5;
+                float x = (i+.5)*im.w/w - .5;
+                set_pixel(r, i, j, k, bilinear_interpolate(im, x, y, k));
+            }
+        }
+    }
+    return r;
+}
+
+int same_image(image a, image b)
+{
+    int i;
+    if(a.w != b.w || a.h != b.h || a.c != b.c) return 0;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        if(!within_eps(a.data[i], b.data[i])) return 0;
+    }
+    return 1;
+}
+
+void test_resize()
+{
+    int i, j, k;
+    image im = make_random_image(23, 17, 3, 1);
+    int sizes[][2] = {{50, 40}, {23, 17}, {16, 12}, {13, 30}, {12, 9}};
+    int ok = 1;
+    for(i = 0; i < 5; ++i){
+        image a = bilinear_resize(im, sizes[i][0], sizes[i][1]);
+        image b = slow_bilinear_resize(im, sizes[i][0], sizes[i][1]);
+        ok &= same_image(a, b);
+        free_image(a);
+        free_image(b);
+    }
+    TEST(ok);
+
+    // Shrinking 4x averages each 4x4 block
+    image big = make_random_image(32, 16, 2, 1);
+    image small = bilinear_resize(big, 8, 4);
+    ok = 1;
+    for(k = 0; k < 2; ++k){
+        for(j = 0; j < 4; ++j){
+            for(i = 0; i < 8; ++i){
+                int x, y;
+                float sum = 0;
+                for(y = 0; y < 4; ++y){
+                    for(x = 0; x < 4; ++x) sum += get_pixel(big, i*4 + x, j*4 + y, k);
+                }
+                if(!within_eps(get_pixel(small, i, j, k), sum/16)) ok = 0;
+            }
+        }
+    }
+    TEST(ok);
+
+    // Uneven shrinks keep the overall brightness
+    image odd = bilinear_resize(big, 5, 3);
+    float mean_big = 0, mean_odd = 0;
+    for(i = 0; i < big.w*big.h*big.c; ++i) mean_big += big.data[i]/(big.w*big.h*big.c);
+    for(i = 0; i < odd.w*odd.h*odd.c; ++i) mean_odd += odd.data[i]/(odd.w*odd.h*odd.c);
+    TEST(fabs(mean_big - mean_odd) < .05);
+
+    free_image(im);
+    free_image(big);
+    free_image(small);
+    free_image(odd);
+}
+
+void test_load_image()
+{
+    int c, i, k;
+    int ok = 1;
+    for(c = 1; c <= 4; ++c){
+        // Odd sizes so the vector loops have leftovers
+        image im = make_random_image(37, 5, c, 1);
+        save_image_options(im, "/tmp/uwnet_test_image", PNG, 0);
+        image loaded = load_image("/tmp/uwnet_test_image.png");
+        int keep = (c == 4) ? 3 : c;
+        if(loaded.w != im.w || loaded.h != im.h || loaded.c != keep) ok = 0;
+        else for(k = 0; k < keep; ++k){
+            for(i = 0; i < im.w*im.h; ++i){
+                unsigned char b = 255*im.data[k*im.w*im.h + i];
+                if(lrintf(loaded.data[k*im.w*im.h + i]*255) != b) ok = 0;
+            }
+        }
+        free_image(im);
+        free_image(loaded);
+    }
+    TEST(ok);
+}
+
+void test_load_image_scaled()
+{
+    int i, j, k, t, q;
+    int ok = 1;
+    int sizes[][2] = {{200, 112}, {150, 60}, {90, 50}, {40, 20}, {20, 10}};
+    for(q = 0; q < 3; ++q){
+        // Smooth so JPEG keeps it close, 200 wide so the last MCU is partial
+        int c = q ? 3 : 1;
+        image im = make_image(200, 112, c);
+        for(k = 0; k < c; ++k){
+            for(j = 0; j < im.h; ++j){
+                for(i = 0; i < im.w; ++i){
+                    set_pixel(im, i, j, k, .5 + .4*sinf(i*.02 + j*.01*(k+1)));
+                }
+            }
+        }
+        save_image_options(im, "/tmp/uwnet_test_scaled", JPG, q == 2 ? 75 : 95);
+        image full = load_image("/tmp/uwnet_test_scaled.jpg");
+        for(t = 0; t < sizeof(sizes)/sizeof(sizes[0]); ++t){
+            int w = sizes[t][0], h = sizes[t][1];
+            image a = load_image_scaled("/tmp/uwnet_test_scaled.jpg", 0, w, h);
+            image b = bilinear_resize(full, w, h);
+            float err = 0;
+            if(a.w != w || a.h != h || a.c != full.c){
+                ok = 0;
+            } else {
+                for(i = 0; i < w*h*a.c; ++i) err += fabsf(a.data[i] - b.data[i]);
+                if(err/(w*h*a.c) > .01) ok = 0;
+            }
+            free_image(a);
+            free_image(b);
+        }
+        free_image(full);
+        free_image(im);
+    }
+    TEST(ok);
+}
+
+// Decoding at 1/2, 1/4 and 1/8 scale matches a full decode resized down
+// Odd sizes leave partial blocks at the edges, and 4:2:0 chroma has its
+// own partial blocks at half the size. The scaled decode is checked
+// before any resize, and a partial block still makes a whole pixel, so
+// the full decode is padded out to whole blocks the way the encoder pads,
+// by repeating the edge, before it is resized.
+void test_load_image_scaled_odd()
+{
+    int i, j, k, q, s, t;
+    int ok = 1;
+    int sizes[][2] = {{203, 117}, {61, 37}, {17, 9}};
+    for(t = 0; t < sizeof(sizes)/sizeof(sizes[0]); ++t){
+        for(q = 0; q < 3; ++q){
+            // Gray and color written here (4:4:4), then a checked-in 4:2:0
+            // file of the same picture since stb_image_write can't make one
+            char file[256] = "/tmp/uwnet_test_odd.jpg";
+            int c = q ? 3 : 1;
+            image im = make_image(sizes[t][0], sizes[t][1], c);
+            for(k = 0; k < c; ++k){
+                for(j = 0; j < im.h; ++j){
+                    for(i = 0; i < im.w; ++i){
+                        set_pixel(im, i, j, k, .5 + .4*sinf(i*.02 + j*.01*(k+1)));
+                    }
+                }
+            }
+            if(q == 2){
+                sprintf(file, "data/test/odd420_%dx%d.jpg", im.w, im.h);
+            } else {
+                save_image_options(im, "/tmp/uwnet_test_odd", JPG, 95);
+            }
+            image full = load_image(file);
+            if(full.w != im.w || full.h != im.h) ok = 0;
+            for(s = 1; s <= 3; ++s){
+                int round = (1 << s) - 1;
+                int w = (im.w + round) >> s, h = (im.h + round) >> s;
+                stbi_set_jpeg_min_size(w, h);
+                image a = load_image_stb(file, 0);
+                stbi_set_jpeg_min_size(0, 0);
+                image padded = make_image(w << s, h << s, full.c);
+                for(k = 0; k < padded.c; ++k){
+                    for(j = 0; j < padded.h; ++j){
+                        for(i = 0; i < padded.w; ++i){
+                            set_pixel(padded, i, j, k, get_pixel(full, i, j, k));
+                        }
+                    }
+                }
+                image b = bilinear_resize(padded, w, h);
+                free_image(padded);
+                float err = 0;
+                if(a.w != w || a.h != h || a.c != full.c){
+                    ok = 0;
+                } else {
+                    for(i = 0; i < w*h*a.c; ++i) err += fabsf(a.data[i] - b.data[i]);
+                    if(err/(w*h*a.c) > .01) ok = 0;
+                }
+                free_image(a);
+                free_image(b);
+            }
+            free_image(full);
+            free_image(im);
+        }
+    }
+    unlink("/tmp/uwnet_test_odd.jpg");
+    TEST(ok);
+}
+
+void test_augment()
+{
+    int w = 13, h = 5, c = 2;
+    int n = 16;
+    int i, j, k;
+    data d = make_data(n, w*h*c, 3);
+    free_matrix(d.x);
+    d.x = random_matrix(n, w*h*c, 1);
+    int ind[16];
+    for(i = 0; i < n; ++i){
+        ind[i] = n-1-i;
+        d.y.data[i*d.y.ld + i%3] = 1;
+    }
+    data plain = make_batch(d, n);
+    data b = make_batch(d, n);
+    gather_batch(d, ind, plain);
+    unsigned long long state = 5;
+
+    augment a = {w, h, c, 0, 0, 0};
+    augment_data(&d, a);
+    augment_batch(d, ind, b, &state);
+    TEST(same_matrix(plain.x, b.x) && same_matrix(plain.y, b.y));
+
+    // Flips only: every row is either untouched or mirrored
+    d.aug.flip = 1;
+    augment_batch(d, ind, b, &state);
+    int ok = 1, flipped = 0;
+    for(i = 0; i < n; ++i){
+        float *p = plain.x.data + i*plain.x.ld;
+        float *q = b.x.data + i*b.x.ld;
+        int same = 1, mirror = 1;
+        for(k = 0; k < h*c; ++k){
+            for(j = 0; j < w; ++j){
+                if(!within_eps(q[k*w + j], p[k*w + j])) same = 0;
+                if(!within_eps(q[k*w + j], p[k*w + w-1-j])) mirror = 0;
+            }
+        }
+        ok &= same || mirror;
+        flipped += mirror && !same;
+    }
+    TEST(ok && flipped > 0 && flipped < n);
+
+    // Zoomed and shifted pixels are blends of each plane's own pixels
+    d.aug.scale = .5;
+    d.aug.crop = 2;
+    unsigned long long s1 = 11, s2 = 11;
+    augment_batch(d, ind, b, &s1);
+    ok = 1;
+    for(i = 0; i < n; ++i){
+        for(k = 0; k < c; ++k){
+            float *p = plain.x.data + i*plain.x.ld + k*w*h;
+            float *q = b.x.data + i*b.x.ld + k*w*h;
+            float lo = p[0], hi = p[0];
+            for(j = 0; j < w*h; ++j){
+                if(p[j] < lo) lo = p[j];
+                if(p[j] > hi) hi = p[j];
+            }
+            for(j = 0; j < w*h; ++j){
+                if(q[j] < lo - EPS || q[j] > hi + EPS) ok = 0;
+            }
+        }
+    }
+    TEST(ok);
+    matrix first = copy_matrix(b.x);
+    augment_batch(d, ind, b, &s2);
+    TEST(same_matrix(first, b.x));
+
+    free_matrix(first);
+    free_data(plain);
+    free_data(b);
+    free_data(d);
+}
+
+static void mark_pattern(int i, void *found)
+{
+    ((int *)found)[i] += 1;
+}
+
+void test_matcher()
+{
+    char *patterns[] = {"he", "she", "his", "hers", "", "she", "x/", "e"};
+    int n = sizeof(patterns)/sizeof(patterns[0]);
+    char *texts[] = {"ushers", "", "data/x/his.png", "hhhhe", "sh"};
+    int i, j, t;
+    matcher *m = make_matcher(patterns, n);
+    int same = 1;
+    for(t = 0; t < 5; ++t){
+        int found[8] = {0};
+        int count = match_patterns(m, texts[t], mark_pattern, found);
+        int expected = 0;
+        for(j = 0; j < n; ++j){
+            int hit = strstr(texts[t], patterns[j]) != 0;
+            expected += hit;
+            if(found[j] != hit) same = 0;
+        }
+        if(count != expected) same = 0;
+    }
+    TEST(same);
+    free_matcher(m);
+
+    // Random strings over a small alphabet give lots of overlapping matches
+    unsigned long long state = 7;
+    char words[64][6];
+    char *w[64];
+    for(i = 0; i < 64; ++i){
+        int len = 1 + rand_range(&state, 5);
+        for(j = 0; j < len; ++j) words[i][j] = 'a' + rand_range(&state, 3);
+        words[i][len] = 0;
+        w[i] = words[i];
+    }
+    m = make_matcher(w, 64);
+    same = 1;
+    for(t = 0; t < 200; ++t){
+        char text[32];
+        int len = rand_range(&state, 31);
+        for(j = 0; j < len; ++j) text[j] = 'a' + rand_range(&state, 4);
+        text[len] = 0;
+        int found[64] = {0};
+        match_patterns(m, text, mark_pattern, found);
+        for(j = 0; j < 64; ++j){
+            if(found[j] != (strstr(text, w[j]) != 0)) same = 0;
+        }
+    }
+    TEST(same);
+    free_matcher(m);
+}
+
 void test_activation_layer()
 {
     matrix a = load_matrix("data/test/a.matrix");
@@ -239,25 +1052,18 @@ void test_col2im()
     image col2im_res = col2im(im.w, im.h, im.c, dcol, 3, 2);
     image col2im_res2 = col2im(im.w, im.h, im.c, dcol2, 2, 2);
 
-    matrix col2mat2 = {0};
-    col2mat2.rows = col2im_res2.c;
-    col2mat2.cols = col2im_res2.w*col2im_res2.h;
-    col2mat2.data = col2im_res2.data;
-
-    matrix col2mat = {0};
-    col2mat.rows = col2im_res.c;
-    col2mat.cols = col2im_res.w*col2im_res.h;
-    col2mat.data = col2im_res.data;
+    matrix col2mat2 = float_to_matrix(col2im_res2.data, col2im_res2.c, col2im_res2.w*col2im_res2.h);
+    matrix col2mat = float_to_matrix(col2im_res.data, col2im_res.c, col2im_res.w*col2im_res.h);
 
     matrix truth_col2mat = load_matrix("data/test/col2mat.matrix");
     matrix truth_col2mat2 = load_matrix("data/test/col2mat2.matrix");
     TEST(same_matrix(truth_col2mat, col2mat));
     TEST(same_matrix(truth_col2mat2, col2mat2));
     free_matrix(dcol);
-    free_matrix(col2mat);
+    free_image(col2im_res);
     free_matrix(truth_col2mat);
     free_matrix(dcol2);
-    free_matrix(col2mat2);
+    free_image(col2im_res2);
     free_matrix(truth_col2mat2);
     free_image(im);
 }
@@ -267,15 +1073,8 @@ void test_maxpool_layer()
 {
     image im = load_image("data/test/dog.jpg"); 
 
-    matrix im_mat = {0};
-    im_mat.rows = 1;
-    im_mat.cols = im.w*im.h*im.c;
-    im_mat.data = im.data;
-
-    matrix im_mat3 = {0};
-    im_mat3.rows = 1;
-    im_mat3.cols = im.w*im.h*im.c;
-    im_mat3.data = im.data;
+    matrix im_mat = float_to_matrix(im.data, 1, im.w*im.h*im.c);
+    matrix im_mat3 = float_to_matrix(im.data, 1, im.w*im.h*im.c);
 
     layer max_l = make_maxpool_layer(im.w, im.h, im.c, 2, 2);
     layer max_l3 = make_maxpool_layer(im.w, im.h, im.c, 3, 2);
@@ -301,6 +1100,21 @@ void test_maxpool_layer()
     TEST(same_matrix(truth_max_dx, max_dx));
     TEST(same_matrix(truth_max_dx3, max_dx3));
 
+    // Every example in a batch gets its own gradient
+    matrix two = make_matrix(2, im_mat.cols);
+    matrix two_dy = make_matrix(2, max_dy.cols);
+    int i;
+    for(i = 0; i < 2; ++i){
+        memcpy(two.data + i*two.ld, im_mat.data, im_mat.cols*sizeof(float));
+        memcpy(two_dy.data + i*two_dy.ld, max_dy.data, max_dy.cols*sizeof(float));
+    }
+    free_matrix(max_l.forward(max_l, two));
+    matrix two_dx = max_l.backward(max_l, two_dy);
+    TEST(same_matrix(truth_max_dx, view_rows(two_dx, 0, 1)) && same_matrix(truth_max_dx, view_rows(two_dx, 1, 1)));
+    free_matrix(two);
+    free_matrix(two_dy);
+    free_matrix(two_dx);
+
 
     free_matrix(max_y);
     free_matrix(max_y3);
@@ -395,6 +1209,315 @@ void test_batchnorm_layer()
     free_matrix(y);
 }
 
+net make_test_net()
+{
+    layer *l = calloc(4, sizeof(layer));
+    l[0] = make_convolutional_layer(6, 6, 2, 4, 3, 1);
+    l[1] = make_activation_layer(RELU);
+    l[2] = make_connected_layer(144, 3);
+    l[3] = make_activation_layer(SOFTMAX);
+    net m = {l, 4};
+    return m;
+}
+
+static void count_index(int i, void *ptr)
+{
+    __atomic_fetch_add((int *)ptr + i, 1, __ATOMIC_RELAXED);
+}
+
+static void nested_loop(int i, void *ptr)
+{
+    int *counts = ptr;
+    parallel_for(10, count_index, counts + 1000 + 10*i);
+    count_index(i, counts);
+}
+
+static void add_index(int i, float *acc, void *ptr)
+{
+    acc[0] += i;
+    acc[1 + i%3] += 1;
+}
+
+static void note_thread(int i, void *ptr)
+{
+    pthread_t *seen = ptr;
+    seen[i] = pthread_self();
+    usleep(200);
+}
+
+static void *concurrent_loop(void *ptr)
+{
+    parallel_for(200, note_thread, ptr);
+    return 0;
+}
+
+// Number of different threads that ran a loop of note_thread
+static int loop_threads(pthread_t *seen, int n)
+{
+    int i, j;
+    int count = 0;
+    for(i = 0; i < n; ++i){
+        for(j = 0; j < i && !pthread_equal(seen[i], seen[j]); ++j);
+        count += j == i;
+    }
+    return count;
+}
+
+typedef struct {
+    atomic_int arrived;
+    int n;
+    int ok[4];
+} meeting;
+
+// Wait up to a second for every other call to arrive too
+static void meet(int i, void *ptr)
+{
+    meeting *m = ptr;
+    int k;
+    atomic_fetch_add(&m->arrived, 1);
+    for(k = 0; k < 1000 && atomic_load(&m->arrived) < m->n; ++k) usleep(1000);
+    m->ok[i] = atomic_load(&m->arrived) == m->n;
+}
+
+void test_parallel()
+{
+    int i;
+    set_num_threads(4);
+    TEST(parallel_threads() == 4);
+
+    // Every iteration runs once, nested loops included
+    int *counts = calloc(2000, sizeof(int));
+    parallel_for(1000, count_index, counts);
+    int ok = 1;
+    for(i = 0; i < 1000; ++i) ok &= counts[i] == 1;
+    TEST(ok);
+    memset(counts, 0, 2000*sizeof(int));
+    parallel_for(100, nested_loop, counts);
+    ok = 1;
+    for(i = 0; i < 2000; ++i) ok &= counts[i] == (i < 100 || i >= 1000);
+    TEST(ok);
+    free(counts);
+
+    float sums[4] = {1, 0, 0, 0};
+    parallel_reduce(999, 4, add_index, sums, 0);
+    TEST(sums[0] == 1 + 999*998/2 && sums[1] == 333 && sums[2] == 333 && sums[3] == 333);
+
+    // Loops started from two threads at once share the pool
+    pthread_t *seen = calloc(400, sizeof(pthread_t));
+    pthread_t other;
+    pthread_create(&other, 0, concurrent_loop, seen + 200);
+    parallel_for(200, note_thread, seen);
+    pthread_join(other, 0);
+    TEST(loop_threads(seen, 200) > 1);
+    TEST(loop_threads(seen + 200, 200) > 1);
+    free(seen);
+
+    // run_threads has every call running at the same time
+    meeting all = {0, 4};
+    run_threads(4, meet, &all);
+    TEST(all.ok[0] && all.ok[1] && all.ok[2] && all.ok[3]);
+
+    // Layers split across threads match the test net run on one thread
+    srand(5);
+    net m = make_test_net();
+    matrix x = random_matrix(8, 72, 1);
+    matrix y = forward_net(m, x);
+    set_num_threads(1);
+    matrix y1 = forward_net(m, x);
+    TEST(same_matrix(y, y1));
+    set_num_threads(0);
+    free_matrix(x);
+    free_matrix(y);
+    free_matrix(y1);
+    free_net(m);
+}
+
+void test_parallel_training()
+{
+    int i;
+    srand(3);
+    data d = make_data(40, 72, 3);
+    free_matrix(d.x);
+    d.x = random_matrix(40, 72, 1);
+    for(i = 0; i < 40; ++i) d.y.data[i*d.y.ld + i%3] = 1;
+    srand(4);
+    net serial = make_test_net();
+    srand(4);
+    net parallel = make_test_net();
+
+    // Splitting the batch only changes the order gradients are summed in,
+    // and srand picks the batches for both
+    srand(5);
+    train_image_classifier(serial, d, 16, 3, .01, .9, .001);
+    srand(5);
+    train_image_classifier_parallel(parallel, d, 16, 3, .01, .9, .001, 3);
+    int ok = 1;
+    for(i = 0; i < serial.n; ++i){
+        if(serial.layers[i].w.data) ok &= same_matrix(serial.layers[i].w, parallel.layers[i].w);
+        if(serial.layers[i].b.data) ok &= same_matrix(serial.layers[i].b, parallel.layers[i].b);
+        if(serial.layers[i].dw.data) ok &= same_matrix(serial.layers[i].dw, parallel.layers[i].dw);
+    }
+    TEST(ok);
+
+    // Another seed draws other batches
+    srand(4);
+    net other = make_test_net();
+    srand(6);
+    train_image_classifier(other, d, 16, 3, .01, .9, .001);
+    TEST(!same_matrix(serial.layers[2].dw, other.layers[2].dw));
+    free_net(other);
+
+    // Hogwild! threads learn the set between them and leave the net's own
+    // momentum alone
+    srand(4);
+    net hog = make_test_net();
+    set_num_threads(3);
+    train_image_classifier_hogwild(hog, d, 16, 60, .01, .9, .001, 3);
+    set_num_threads(0);
+    TEST(accuracy_net(hog, d) > .6);
+    matrix zero = make_matrix(hog.layers[0].dw.rows, hog.layers[0].dw.cols);
+    TEST(same_matrix(hog.layers[0].dw, zero));
+    free_matrix(zero);
+    free_net(hog);
+
+    // Replicas share weights but not gradients or saved inputs
+    net r = replicate_net(serial);
+    TEST(r.layers[0].w.data == serial.layers[0].w.data && r.layers[0].dw.data != serial.layers[0].dw.data
+            && r.layers[0].x != serial.layers[0].x);
+    free_replica(r);
+    free_net(serial);
+    free_net(parallel);
+    free_data(d);
+}
+
+// Check the ring sums and training from one rank, returns 1 if they worked
+static int ring_rank_works(char *path, int rank, int size, data d)
+{
+    int i, ok = 1;
+    ring *r = join_ring(path, rank, size);
+
+    // Odd length so the chunks aren't all the same size
+    size_t n = 1003;
+    float *x = calloc(n, sizeof(float));
+    for(i = 0; i < n; ++i) x[i] = rank + i;
+    ring_allreduce(r, x, n);
+    for(i = 0; i < n; ++i) ok &= x[i] == size*(size-1)/2 + size*i;
+    free(x);
+
+    // Every rank starts from a different net but ends up with rank 0's
+    srand(10 + rank);
+    net m = make_test_net();
+    train_image_classifier_ring(m, d, 8, 5, .01, .9, .001, r);
+    matrix w = copy_matrix(m.layers[2].w);
+    ring_allreduce(r, w.data, (size_t)w.rows*w.ld);
+    scal_matrix(1./size, w);
+    ok &= same_matrix(w, m.layers[2].w);
+    free_matrix(w);
+    free_net(m);
+    leave_ring(r);
+    return ok;
+}
+
+void test_ring()
+{
+    int i;
+    int size = 3;
+    srand(3);
+    data d = make_data(48, 72, 3);
+    free_matrix(d.x);
+    d.x = random_matrix(48, 72, 1);
+    for(i = 0; i < 48; ++i) d.y.data[i*d.y.ld + i%3] = 1;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/uwnet-test-ring-%d", (int)getpid());
+    for(i = 1; i < size; ++i){
+        if(fork() == 0) _exit(!ring_rank_works(path, i, size, d));
+    }
+    TEST(ring_rank_works(path, 0, size, d));
+    int ok = 1;
+    for(i = 1; i < size; ++i){
+        int status;
+        wait(&status);
+        ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    TEST(ok);
+    free_data(d);
+}
+
+void test_param_server()
+{
+    int i, j;
+    int workers = 2;
+    srand(3);
+    data d = make_data(48, 72, 3);
+    free_matrix(d.x);
+    d.x = random_matrix(48, 72, 1);
+    // Most inputs are always zero, so most weight gradients are too
+    for(i = 0; i < 48; ++i){
+        d.y.data[i*d.y.ld + i%3] = 1;
+        for(j = 24; j < 72; ++j) d.x.data[i*d.x.ld + j] = 0;
+    }
+    layer *l = calloc(2, sizeof(layer));
+    l[0] = make_connected_layer(72, 3);
+    l[1] = make_activation_layer(SOFTMAX);
+    net m = {l, 2};
+
+    char name[64];
+    snprintf(name, sizeof(name), "/uwnet-test-ps-%d", (int)getpid());
+    param_server *s = serve_net(name, m, workers, 2);
+    TEST(s != 0);
+    for(i = 0; i < workers; ++i){
+        if(fork() == 0){
+            param_server *c = connect_param_server(name);
+            layer *wl = calloc(2, sizeof(layer));
+            wl[0] = make_connected_layer(72, 3);
+            wl[1] = make_activation_layer(SOFTMAX);
+            net w = {wl, 2};
+            int batches = c ? train_image_classifier_worker(w, d, 8, c) : 0;
+            _exit(batches == 0);
+        }
+    }
+    TEST(run_param_server(s, m, 8, 60, .1, .9, .001));
+    int ok = 1;
+    for(i = 0; i < workers; ++i){
+        int status;
+        wait(&status);
+        ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    TEST(ok);
+    long long applied, dropped, sparse;
+    param_server_stats(s, &applied, &dropped, &sparse);
+    TEST(applied == 60);
+    TEST(sparse > 0);
+    TEST(accuracy_net(m, d) > .6);
+    close_param_server(s);
+
+    // With nobody joining, or the only worker killed, the server gives up
+    s = serve_net(name, m, 1, 2);
+    set_param_server_timeout(s, 1);
+    TEST(!run_param_server(s, m, 8, 60, .1, .9, .001));
+    close_param_server(s);
+    s = serve_net(name, m, 1, 2);
+    set_param_server_timeout(s, 1);
+    pid_t worker = fork();
+    if(worker == 0){
+        param_server *c = connect_param_server(name);
+        if(c) train_image_classifier_worker(m, d, 8, c);
+        _exit(0);
+    }
+    if(fork() == 0){
+        usleep(300000);
+        kill(worker, SIGKILL);
+        _exit(0);
+    }
+    TEST(!run_param_server(s, m, 8, 1000000, .1, .9, .001));
+    wait(0);
+    wait(0);
+    close_param_server(s);
+    free_net(m);
+    free_data(d);
+}
+
 void make_matrix_test()
 {
     srand(1);
@@ -470,15 +1593,8 @@ void make_matrix_test()
 
     image im = load_image("data/test/dog.jpg"); 
 
-    matrix im_mat = {0};
-    im_mat.rows = 1;
-    im_mat.cols = im.w*im.h*im.c;
-    im_mat.data = im.data;
-
-    matrix im_mat3 = {0};
-    im_mat3.rows = 1;
-    im_mat3.cols = im.w*im.h*im.c;
-    im_mat3.data = im.data;
+    matrix im_mat = float_to_matrix(im.data, 1, im.w*im.h*im.c);
+    matrix im_mat3 = float_to_matrix(im.data, 1, im.w*im.h*im.c);
 
     layer max_l = make_maxpool_layer(im.w, im.h, im.c, 2, 2);
     layer max_l3 = make_maxpool_layer(im.w, im.h, im.c, 3, 2);
@@ -517,15 +1633,9 @@ void make_matrix_test()
     image col2im_res2 = col2im(im.w, im.h, im.c, dcol2, 2, 2);
     save_matrix(dcol, "data/test/dcol.matrix");
     save_matrix(dcol2, "data/test/dcol2.matrix");
-    matrix col2mat = {0};
-    col2mat.rows = col2im_res.c;
-    col2mat.cols = col2im_res.w*col2im_res.h;
-    col2mat.data = col2im_res.data;
+    matrix col2mat = float_to_matrix(col2im_res.data, col2im_res.c, col2im_res.w*col2im_res.h);
     save_matrix(col2mat, "data/test/col2mat.matrix");
-    matrix col2mat2 = {0};
-    col2mat2.rows = col2im_res2.c;
-    col2mat2.cols = col2im_res2.w*col2im_res2.h;
-    col2mat2.data = col2im_res2.data;
+    matrix col2mat2 = float_to_matrix(col2im_res2.data, col2im_res2.c, col2im_res2.w*col2im_res2.h);
     save_matrix(col2mat2, "data/test/col2mat2.matrix");
 
 
@@ -590,10 +1700,30 @@ void test_matrix_speed()
 void run_tests()
 {
     //make_matrix_test();
+    test_pool();
     test_copy_matrix();
+    test_matrix_views();
     test_axpy_matrix();
     test_transpose_matrix();
     test_matmul();
+    test_sampler();
+    test_read_lines();
+    test_read_files();
+    test_load_data();
+    test_stream();
+    test_lazy_data();
+    test_shared_data();
+    test_parallel();
+    test_parallel_training();
+    test_ring();
+    test_param_server();
+    test_sparse_labels();
+    test_augment();
+    test_resize();
+    test_load_image();
+    test_load_image_scaled();
+    test_load_image_scaled_odd();
+    test_matcher();
     test_activation_layer();
     test_connected_layer();
     test_im2col();
@@ -53,22 +53,161 @@ typedef struct {
 
 matrix forward_net(net m, matrix x);
 void backward_net(net m, matrix d);
+void backward_net_hook(net m, matrix d, void (*done)(int i, void *ctx), void *ctx);
 void update_net(net m, float rate, float momentum, float decay);
 void free_layer(layer l);
 void free_net(net n);
 
+// Copies of a net that share its weights for data-parallel training
+net replicate_net(net m);
+void free_replica(net r);
+
+// Random jitter applied to examples as training batches are made
+typedef struct{
+    int w, h, c;    // size of each example image, planar like x
+    float scale;    // zoom in by up to 1+scale
+    int crop;       // shift by up to this many pixels past each edge
+    int flip;       // mirror half the examples left to right
+} augment;
+
 typedef struct{
     matrix x;
     matrix y;
+
+    // Sparse labels: when labels is set y holds no data of its own and
+    // example i is class labels[i] (or no class if it is negative).
+    // Dense y is still used for soft labels.
+    int *labels;
+
+    // 8-bit storage: when bytes is set x holds no data of its own, row i
+    // of x is bytes + i*x.cols and gets converted to floats as batches are
+    // made, (b/255 - mean[c])/std[c] for channel c
+    unsigned char *bytes;
+    int channels;
+    float mean[4];
+    float std[4];
+
+    // Augmentation for training batches, off when aug.w is 0
+    augment aug;
+
+    // Lazy decoding: when cache is set x holds no data of its own, row i
+    // is image first+i of the cache, decoded the first time it is used
+    struct image_cache *cache;
+    int first;
+
+    // File mapping backing bytes and labels, if there is one
+    void *map;
+    size_t map_size;
+    int shallow;
 } data;
+
+// Draws minibatches without replacement from a fresh shuffle of the
+// examples each epoch. Each sampler has its own random state so threads
+// can sample independently.
+typedef struct{
+    int *order;
+    int n;
+    int pos;
+    int epoch;
+    int sorted;
+    unsigned long long state;
+} sampler;
+
+sampler make_sampler(int n, unsigned long long seed);
+void free_sampler(sampler s);
+void sample_indexes(sampler *s, int *ind, int n);
+
+unsigned int rand_next(unsigned long long *state);
+int rand_range(unsigned long long *state, int n);
+unsigned long long rand_seed();
+
+data make_data(int n, int inputs, int outputs);
+data make_batch(data d, int n);
+void gather_batch(data d, int *ind, data b);
 data random_batch(data d, int n);
+data view_data(data d, int start, int n);
+int has_float_examples(data d);
+
+// Decoded images kept for lazy data sets, least recently used go first
+typedef struct image_cache image_cache;
+data load_image_classification_lazy(char *images, char *label_file, int w, int h, size_t cache_bytes);
+data load_image_classification_compressed(char *images, char *label_file);
+void cache_example(image_cache *c, int i, float *dst);
+void cache_batch(image_cache *c, int *ind, int n, float *dst, int ld);
+void cache_stats(image_cache *c, long long *hits, long long *misses);
+void free_image_cache(image_cache *c);
+
+// Assembles batches on a background thread so they are ready before the
+// training loop asks for them
+typedef struct loader loader;
+loader *start_loader(data d, int batch, unsigned long long seed);
+data loader_next(loader *l);
+void stop_loader(loader *l);
+
+// Streams training examples from packed shards on disk with bounded memory
+typedef struct stream stream;
+stream *open_stream(char *shard_list, int buffer, unsigned long long seed);
+void normalize_stream(stream *s, int channels, float *mean, float *std);
+data stream_format(stream *s);
+int stream_batch(stream *s, data b);
+long long stream_examples(stream *s);
+int stream_epoch(stream *s);
+void close_stream(stream *s);
+loader *start_stream_loader(stream *s, int batch);
+
+// Processes on one machine that sum gradients around a ring of sockets
+typedef struct ring ring;
+ring *join_ring(char *path, int rank, int size);
+int ring_rank(ring *r);
+int ring_size(ring *r);
+void ring_allreduce(ring *r, float *x, size_t n);
+void ring_sync_net(ring *r, net m);
+void leave_ring(ring *r);
+
+// One process owning a net's weights in shared memory, updated with
+// gradients that worker processes send it whenever they are ready
+typedef struct param_server param_server;
+param_server *serve_net(char *name, net m, int workers, int staleness);
+param_server *connect_param_server(char *name);
+int run_param_server(param_server *s, net m, int batch, int updates, float rate, float momentum, float decay);
+void set_param_server_timeout(param_server *s, int seconds);
+void param_server_stats(param_server *s, long long *applied, long long *dropped, long long *sparse);
+void close_param_server(param_server *s);
+
 data load_image_classification_data(char *images, char *label_file);
+data load_image_classification_bytes(char *images, char *label_file);
+data load_image_classification_shared(char *images, char *label_file);
+int unshare_image_classification_data(char *images, char *label_file);
+void normalize_data(data *d, int channels, float *mean, float *std);
+void augment_data(data *d, augment a);
+void augment_batch(data d, int *ind, data b, unsigned long long *state);
+int pack_image_classification_data(char *images, char *label_file, char *filename);
+int pack_image_classification_shards(char *images, char *label_file, char *prefix, int per_shard);
+int load_packed_data(char *filename, char *images, char *label_file, data *d);
 void free_data(data d);
 void train_image_classifier(net m, data d, int batch, int iters, float rate, float momentum, float decay);
+void train_image_classifier_stream(net m, stream *s, int batch, int iters, float rate, float momentum, float decay);
+void train_image_classifier_parallel(net m, data d, int batch, int iters, float rate, float momentum, float decay, int threads);
+void train_image_classifier_hogwild(net m, data d, int batch, int iters, float rate, float momentum, float decay, int threads);
+void train_image_classifier_ring(net m, data d, int batch, int iters, float rate, float momentum, float decay, ring *r);
+int train_image_classifier_worker(net m, data d, int batch, param_server *s);
 float accuracy_net(net m, data d);
 
 char *fgetl(FILE *fp);
 
+// Every line of a text file, read in one go. line[i] points into buf,
+// which holds the file with each newline replaced by a terminator.
+typedef struct{
+    char **line;
+    int n;
+    char *buf;
+    size_t size;
+    int mapped;
+} lines;
+
+lines read_lines(char *filename);
+void free_lines(lines l);
+
 matrix im2col(image im, int size, int stride);
 image col2im(int width, int height, int channels, matrix col, int size, int stride);
 
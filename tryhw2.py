@@ -55,8 +55,10 @@ def conv_batch_net():
 
 
 print("loading data...")
-train = load_image_classification_data("cifar/cifar.train", "cifar/cifar.labels")
-test  = load_image_classification_data("cifar/cifar.test",  "cifar/cifar.labels")
+# Shared so every run of a sweep on this machine uses one decoded copy,
+# ./uwnet unshare <list> <labels> frees it when the sweep is done
+train = load_image_classification_shared("cifar/cifar.train", "cifar/cifar.labels")
+test  = load_image_classification_shared("cifar/cifar.test",  "cifar/cifar.labels")
 print("done")
 print
 
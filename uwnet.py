@@ -26,12 +26,32 @@ class IMAGE(Structure):
 class MATRIX(Structure):
     _fields_ = [("rows", c_int),
                 ("cols", c_int),
+                ("ld", c_int),
                 ("data", POINTER(c_float)),
                 ("shallow", c_int)]
 
+class AUGMENT(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("scale", c_float),
+                ("crop", c_int),
+                ("flip", c_int)]
+
 class DATA(Structure):
     _fields_ = [("x", MATRIX),
-                ("y", MATRIX)]
+                ("y", MATRIX),
+                ("labels", POINTER(c_int)),
+                ("bytes", POINTER(c_ubyte)),
+                ("channels", c_int),
+                ("mean", c_float*4),
+                ("std", c_float*4),
+                ("aug", AUGMENT),
+                ("cache", c_void_p),
+                ("first", c_int),
+                ("map", c_void_p),
+                ("map_size", c_size_t),
+                ("shallow", c_int)]
 
 class LAYER(Structure):
     pass
@@ -139,6 +159,78 @@ train_image_classifier = lib.train_image_classifier
 train_image_classifier.argtypes = [NET, DATA, c_int, c_int, c_float, c_float, c_float]
 train_image_classifier.restype = None
 
+train_image_classifier_parallel = lib.train_image_classifier_parallel
+train_image_classifier_parallel.argtypes = [NET, DATA, c_int, c_int, c_float, c_float, c_float, c_int]
+train_image_classifier_parallel.restype = None
+
+train_image_classifier_hogwild = lib.train_image_classifier_hogwild
+train_image_classifier_hogwild.argtypes = [NET, DATA, c_int, c_int, c_float, c_float, c_float, c_int]
+train_image_classifier_hogwild.restype = None
+
+set_num_threads = lib.set_num_threads
+set_num_threads.argtypes = [c_int]
+set_num_threads.restype = None
+
+open_stream_lib = lib.open_stream
+open_stream_lib.argtypes = [c_char_p, c_int, c_ulonglong]
+open_stream_lib.restype = c_void_p
+
+def open_stream(shard_list, buffer=10000, seed=0):
+    return open_stream_lib(shard_list.encode('utf-8'), buffer, seed)
+
+close_stream = lib.close_stream
+close_stream.argtypes = [c_void_p]
+close_stream.restype = None
+
+train_image_classifier_stream = lib.train_image_classifier_stream
+train_image_classifier_stream.argtypes = [NET, c_void_p, c_int, c_int, c_float, c_float, c_float]
+train_image_classifier_stream.restype = None
+
+join_ring_lib = lib.join_ring
+join_ring_lib.argtypes = [c_char_p, c_int, c_int]
+join_ring_lib.restype = c_void_p
+
+def join_ring(path, rank, size):
+    return join_ring_lib(path.encode('utf-8'), rank, size)
+
+leave_ring = lib.leave_ring
+leave_ring.argtypes = [c_void_p]
+leave_ring.restype = None
+
+train_image_classifier_ring = lib.train_image_classifier_ring
+train_image_classifier_ring.argtypes = [NET, DATA, c_int, c_int, c_float, c_float, c_float, c_void_p]
+train_image_classifier_ring.restype = None
+
+serve_net_lib = lib.serve_net
+serve_net_lib.argtypes = [c_char_p, NET, c_int, c_int]
+serve_net_lib.restype = c_void_p
+
+def serve_net(name, m, workers, staleness):
+    return serve_net_lib(name.encode('utf-8'), m, workers, staleness)
+
+connect_param_server_lib = lib.connect_param_server
+connect_param_server_lib.argtypes = [c_char_p]
+connect_param_server_lib.restype = c_void_p
+
+def connect_param_server(name):
+    return connect_param_server_lib(name.encode('utf-8'))
+
+run_param_server = lib.run_param_server
+run_param_server.argtypes = [c_void_p, NET, c_int, c_int, c_float, c_float, c_float]
+run_param_server.restype = c_int
+
+set_param_server_timeout = lib.set_param_server_timeout
+set_param_server_timeout.argtypes = [c_void_p, c_int]
+set_param_server_timeout.restype = None
+
+train_image_classifier_worker = lib.train_image_classifier_worker
+train_image_classifier_worker.argtypes = [NET, DATA, c_int, c_void_p]
+train_image_classifier_worker.restype = c_int
+
+close_param_server = lib.close_param_server
+close_param_server.argtypes = [c_void_p]
+close_param_server.restype = None
+
 accuracy_net = lib.accuracy_net
 accuracy_net.argtypes = [NET, DATA]
 accuracy_net.restype = c_float
@@ -154,6 +246,55 @@ load_image_classification_data_lib.restype = DATA
 def load_image_classification_data(images, labels):
     return load_image_classification_data_lib(images.encode('utf-8'), labels.encode('utf-8'))
 
+load_image_classification_bytes_lib = lib.load_image_classification_bytes
+load_image_classification_bytes_lib.argtypes = [c_char_p, c_char_p]
+load_image_classification_bytes_lib.restype = DATA
+
+def load_image_classification_bytes(images, labels):
+    return load_image_classification_bytes_lib(images.encode('utf-8'), labels.encode('utf-8'))
+
+load_image_classification_shared_lib = lib.load_image_classification_shared
+load_image_classification_shared_lib.argtypes = [c_char_p, c_char_p]
+load_image_classification_shared_lib.restype = DATA
+
+def load_image_classification_shared(images, labels):
+    return load_image_classification_shared_lib(images.encode('utf-8'), labels.encode('utf-8'))
+
+unshare_image_classification_data_lib = lib.unshare_image_classification_data
+unshare_image_classification_data_lib.argtypes = [c_char_p, c_char_p]
+unshare_image_classification_data_lib.restype = c_int
+
+def unshare_image_classification_data(images, labels):
+    return unshare_image_classification_data_lib(images.encode('utf-8'), labels.encode('utf-8'))
+
+load_image_classification_lazy_lib = lib.load_image_classification_lazy
+load_image_classification_lazy_lib.argtypes = [c_char_p, c_char_p, c_int, c_int, c_size_t]
+load_image_classification_lazy_lib.restype = DATA
+
+def load_image_classification_lazy(images, labels, w=0, h=0, cache_bytes=1<<30):
+    return load_image_classification_lazy_lib(images.encode('utf-8'), labels.encode('utf-8'), w, h, cache_bytes)
+
+load_image_classification_compressed_lib = lib.load_image_classification_compressed
+load_image_classification_compressed_lib.argtypes = [c_char_p, c_char_p]
+load_image_classification_compressed_lib.restype = DATA
+
+def load_image_classification_compressed(images, labels):
+    return load_image_classification_compressed_lib(images.encode('utf-8'), labels.encode('utf-8'))
+
+normalize_data_lib = lib.normalize_data
+normalize_data_lib.argtypes = [POINTER(DATA), c_int, POINTER(c_float), POINTER(c_float)]
+normalize_data_lib.restype = None
+
+def normalize_data(d, mean, std):
+    normalize_data_lib(byref(d), len(mean), c_array(c_float, mean), c_array(c_float, std))
+
+augment_data_lib = lib.augment_data
+augment_data_lib.argtypes = [POINTER(DATA), AUGMENT]
+augment_data_lib.restype = None
+
+def augment_data(d, w, h, c, scale=0, crop=0, flip=0):
+    augment_data_lib(byref(d), AUGMENT(w, h, c, scale, crop, flip))
+
 make_connected_layer = lib.make_connected_layer
 make_connected_layer.argtypes = [c_int, c_int]
 make_connected_layer.restype = LAYER
@@ -196,6 +337,7 @@ def run_net_image(net, im):
     m = MATRIX()
     m.rows = 1
     m.cols = im.h*im.w*im.c
+    m.ld = m.cols
     m.data = im.data
     m.shallow = 1
     return forward_net(net, m)